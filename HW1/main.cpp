@@ -1,5 +1,8 @@
 // Minimal image toolkit (pure std::C++): RAW(512x512, 8-bit gray), PGM/PPM(P5/P6), BMP(8/24-bit BI_RGB)
-// Ops: negative / log / gamma, resize (nearest / bilinear)
+// Ops: negative / log / gamma / tone curves / equalize / CLAHE / auto-levels / color LUT (.cube), histogram stats,
+//      thresholding (fixed / Otsu / multi-Otsu), image arithmetic (add / sub / absdiff / mul / blend),
+//      false-color overlay and colormaps (hot / jet / bone / viridis), resize (nearest / bilinear / area / bicubic / lanczos3),
+//      affine warp / rotation (nearest / bilinear)
 // All pixels are row-major, interleaved (c = 1 or 3).
 // Pixel-centered resampling: fx = (x+0.5)*sx - 0.5 (prevents half-pixel bias).
 #include <iostream>
@@ -10,23 +13,52 @@
 #include <cmath>
 #include <iomanip>
 #include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+// SSE2 is baseline on x86-64; wider paths are enabled by compiler flags (e.g. -march=native).
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 // Image memory layout (row-major, interleaved):
 // offset(i,j,k) = ((i * w) + j) * c + k
-struct Image {
+// T is the sample type: uint8_t for the usual 8-bit images, uint16_t for 16-bit PGM/PPM.
+template <typename T>
+struct ImageT {
     // width, height, channels (1=PGM/RAW, 3=PPM)
     int w = 0, h = 0, c = 0;
     // size = w*h*c
-    vector<uint8_t> data;
+    vector<T> data;
     bool empty() const { return data.empty(); }
 };
+using Image   = ImageT<uint8_t>;
+using Image16 = ImageT<uint16_t>;
+using ImageF  = ImageT<float>;     // nominal range 0..1 (no file format; used by the API)
 
-struct Image;
 static Image load_raw_grayscale(const string& path, int w, int h);
-static Image load_bmp(const string& path);
+static Image load_bmp(const string& path, bool gray = false);
 static Image load_by_extension(const string& path);
+static inline uint32_t luma_u8(uint32_t r, uint32_t g, uint32_t b);
 
 // --- extension helpers (deal with file) ---
 static string to_lower(string s) {
@@ -81,7 +113,7 @@ static void dump_center_10x10(const Image& img, const string& tag) {
         const uint8_t* p = &img.data[(static_cast<size_t>(y)*img.w + x)*img.c];
         if (img.c == 1) return p[0];
         // luminance for display
-        return static_cast<int>(lround(0.299*p[0] + 0.587*p[1] + 0.114*p[2]));
+        return static_cast<int>(luma_u8(p[0], p[1], p[2]));
     };
 
     for (int y = y0; y < y1; ++y) {
@@ -93,6 +125,218 @@ static void dump_center_10x10(const Image& img, const string& tag) {
     cout << "---------------------------------------------\n";
 }
 
+// --------------------- Threading ---------------------
+// g_threads: worker count used by parallel_rows() / parallel_bands(); 0 => hardware_concurrency().
+// Set from the CLI with --threads=N.
+static int g_threads = 0;
+
+static int thread_count() {
+    if (g_threads > 0) return g_threads;
+    unsigned hc = thread::hardware_concurrency();
+    return hc ? static_cast<int>(hc) : 1;
+}
+
+// ThreadPool: persistent workers behind parallel_rows() / parallel_bands(). Started on first use
+// (thread_count() - 1 workers; the calling thread is the last one), so a parallel call costs a
+// wake-up instead of creating and joining threads. run(n, fn) calls fn(i) for every i in [0,n):
+// tasks are handed out through an atomic counter and run() returns once all have finished.
+// A run() issued from inside a task executes inline, so nested parallel calls cannot deadlock.
+class ThreadPool {
+public:
+    static ThreadPool& get() { static ThreadPool pool; return pool; }
+
+    void run(int n, const function<void(int)>& fn) {
+        if (n <= 0) return;
+        const int want = thread_count() - 1;
+        if (n == 1 || want <= 0 || in_task()) { for (int i = 0; i < n; ++i) fn(i); return; }
+        if (static_cast<int>(workers_.size()) != want) start(want);
+        {
+            lock_guard<mutex> lk(m_);
+            job_ = &fn; jobN_ = n; next_ = 0;
+            active_ = static_cast<int>(workers_.size());
+            ++gen_;
+        }
+        wake_.notify_all();
+        in_task() = true;
+        drain();
+        in_task() = false;
+        unique_lock<mutex> lk(m_);
+        done_.wait(lk, [&]() { return active_ == 0; });
+        job_ = nullptr;
+    }
+
+    ~ThreadPool() { stop(); }
+
+private:
+    static bool& in_task() { static thread_local bool t = false; return t; }
+
+    void drain() {
+        for (int i = next_.fetch_add(1); i < jobN_; i = next_.fetch_add(1)) (*job_)(i);
+    }
+
+    void start(int n) {
+        stop();
+        workers_.reserve(n);
+        for (int t = 0; t < n; ++t) workers_.emplace_back([this, g = gen_]() { loop(g); });
+    }
+
+    void stop() {
+        { lock_guard<mutex> lk(m_); quit_ = true; }
+        wake_.notify_all();
+        for (auto& th : workers_) th.join();
+        workers_.clear();
+        quit_ = false;
+    }
+
+    void loop(uint64_t seen) {
+        in_task() = true;
+        for (;;) {
+            unique_lock<mutex> lk(m_);
+            wake_.wait(lk, [&]() { return quit_ || gen_ != seen; });
+            if (quit_) return;
+            seen = gen_;
+            lk.unlock();
+            drain();
+            lk.lock();
+            if (--active_ == 0) done_.notify_one();
+        }
+    }
+
+    vector<thread> workers_;
+    mutex m_;
+    condition_variable wake_, done_;
+    const function<void(int)>* job_ = nullptr;
+    int jobN_ = 0;
+    atomic<int> next_{0};
+    int active_ = 0;       // workers that have not finished the current job
+    uint64_t gen_ = 0;     // bumped once per job; workers wait for a change
+    bool quit_ = false;
+};
+
+// parallel_rows(h, fn):
+// Splits rows [0,h) into one contiguous band per worker and calls fn(y0, y1).
+// Bands are disjoint, so kernels writing only their own rows need no locking.
+template <typename F>
+static void parallel_rows(int h, F fn) {
+    const int n = min(thread_count(), h);
+    if (n <= 1) { if (h > 0) fn(0, h); return; }
+    ThreadPool::get().run(n, [&](int t) {
+        fn(static_cast<int>(static_cast<long long>(h) * t / n), static_cast<int>(static_cast<long long>(h) * (t + 1) / n));
+    });
+}
+
+// parallel_bands(h, band, fn):
+// Like parallel_rows(), but with fixed bands of `band` rows (the last one shorter) handed out to
+// the workers as they free up. The banding depends only on h and band, never on the thread count.
+template <typename F>
+static void parallel_bands(int h, int band, F fn) {
+    if (h <= 0) return;
+    band = max(1, band);
+    ThreadPool::get().run((h + band - 1) / band, [&](int b) { fn(b * band, min(h, (b + 1) * band)); });
+}
+
+// parallel_tiles(w, h, tw, th, fn):
+// 2D version of parallel_bands(): fn(x0, x1, y0, y1) for every tile of a tw x th grid over
+// [0,w) x [0,h), tiles handed out in row-major order as workers free up.
+template <typename F>
+static void parallel_tiles(int w, int h, int tw, int th, F fn) {
+    if (w <= 0 || h <= 0) return;
+    tw = max(1, tw); th = max(1, th);
+    const int nx = (w + tw - 1) / tw;
+    ThreadPool::get().run(nx * ((h + th - 1) / th), [&](int t) {
+        const int x0 = (t % nx) * tw, y0 = (t / nx) * th;
+        fn(x0, min(w, x0 + tw), y0, min(h, y0 + th));
+    });
+}
+
+// scratch_buffer<T>(slot, n): per-thread buffer of at least n elements, kept for the life of the
+// thread so banded kernels do not allocate (and fault in) their row buffers once per band.
+// Contents are left over from earlier use; slot separates buffers a kernel holds at the same time.
+template <typename T>
+static T* scratch_buffer(int slot, size_t n) {
+    static thread_local vector<T> bufs[4];
+    if (bufs[slot].size() < n) bufs[slot].resize(n);
+    return bufs[slot].data();
+}
+
+// luma_u8(r, g, b): BT.601 luminance in 8.8 fixed point, Y = (77R + 150G + 29B + 128) >> 8.
+// Also valid for 16-bit samples (the products stay below 2^32).
+static inline uint32_t luma_u8(uint32_t r, uint32_t g, uint32_t b) {
+    return (77u * r + 150u * g + 29u * b + 128u) >> 8;
+}
+
+// 8.8 fixed-point luma weights in R,G,B order; each row sums to 256 so white stays 255.
+//   BT.601: 0.299 0.587 0.114  -> 77 150 29   (same as luma_u8)
+//   BT.709: 0.2126 0.7152 0.0722 -> 54 183 19
+enum class LumaWeights { BT601, BT709 };
+static const uint16_t kLumaW[2][3] = { { 77, 150, 29 }, { 54, 183, 19 } };
+
+// gray_row(src, dst, n, w): n interleaved 3-byte pixels -> n gray bytes,
+// Y = (w0*s0 + w1*s1 + w2*s2 + 128) >> 8. w is in memory order, so BGR rows pass {wb, wg, wr}.
+// SSSE3: 16 pixels per iteration; three pshufb per plane deinterleave the 48 loaded bytes,
+// then 16-bit multiply-adds (max 255*256 + 128, fits unsigned 16-bit).
+static void gray_row(const uint8_t* src, uint8_t* dst, size_t n, const uint16_t w[3]) {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i m0[3] = { _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+                            _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+                            _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+    const __m128i m1[3] = { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1) };
+    const __m128i m2[3] = { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13),
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14),
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15) };
+    const __m128i zero = _mm_setzero_si128(), r128 = _mm_set1_epi16(128);
+    const __m128i vw[3] = { _mm_set1_epi16(static_cast<short>(w[0])), _mm_set1_epi16(static_cast<short>(w[1])),
+                            _mm_set1_epi16(static_cast<short>(w[2])) };
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i));
+        const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i + 16));
+        const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i + 32));
+        __m128i lo = r128, hi = r128;
+        for (int k = 0; k < 3; ++k) {
+            const __m128i p = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m0[k]), _mm_shuffle_epi8(v1, m1[k])),
+                                           _mm_shuffle_epi8(v2, m2[k]));
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), vw[k]));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), vw[k]));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; i < n; ++i) {
+        const uint8_t* p = src + 3 * i;
+        dst[i] = static_cast<uint8_t>((w[0] * p[0] + w[1] * p[1] + w[2] * p[2] + 128u) >> 8);
+    }
+}
+
+static void gray_row(const uint16_t* src, uint16_t* dst, size_t n, const uint16_t w[3]) {
+    for (size_t i = 0; i < n; ++i) {
+        const uint16_t* p = src + 3 * i;
+        dst[i] = static_cast<uint16_t>((w[0] * uint32_t(p[0]) + w[1] * uint32_t(p[1]) + w[2] * uint32_t(p[2]) + 128u) >> 8);
+    }
+}
+
+// op_gray(in, weights): RGB -> single channel (c=1 inputs are returned unchanged). Threaded.
+template <typename T>
+static ImageT<T> op_gray(const ImageT<T>& in, LumaWeights wts = LumaWeights::BT601) {
+    if (in.empty() || in.c == 1) return in;
+    ImageT<T> out; out.w = in.w; out.h = in.h; out.c = 1;
+    out.data.resize(static_cast<size_t>(in.w) * in.h);
+    const uint16_t* w = kLumaW[static_cast<int>(wts)];
+    parallel_rows(in.h, [&](int y0, int y1) {
+        const size_t n = static_cast<size_t>(in.w) * (y1 - y0);
+        gray_row(&in.data[static_cast<size_t>(in.w) * y0 * 3], &out.data[static_cast<size_t>(in.w) * y0], n, w);
+    });
+    return out;
+}
+
+// Loader option (--gray): load_by_extension() returns single-channel images; BMPs convert
+// each row during decode so the RGB image is never materialized.
+static bool g_load_gray = false;
+static LumaWeights g_luma_weights = LumaWeights::BT601;
+
 // --- Little-endian readers ---
 static uint16_t rd_u16(istream& in) {
     unsigned char b[2]; in.read((char*)b, 2);
@@ -116,20 +360,29 @@ static inline int bmp_row_size_bytes(int bitsPerPixel, int w) {
     return rawBytes + pad;
 }
 
-// load_bmp():
+// BmpRows: decoder state for reading a BMP one row at a time (load_bmp() and RowReader).
 // Supports BI_RGB only: 8-bit indexed (palette) and 24-bit BGR.
 // Row stride is padded to 4 bytes; height < 0 => top-down.
-// Converts to internal RGB (c=3). Palette entries are BGRA.
-static Image load_bmp(const string& path) {
-    Image img;
-    ifstream in(path, ios::binary);
-    if (!in) { cerr << "Cannot open BMP " << path << "\n"; return img; }
+// Rows decode to RGB (c=3). Palette entries are BGRA.
+// gray=true: decode straight to c=1 with g_luma_weights (palette entries are converted once).
+struct BmpRows {
+    int w = 0, h = 0, c = 0;          // decoded geometry
+    bool topDown = false, gray = false;
+    int bpp = 0, rowBytes = 0;
+    streamoff offBits = 0;
+    vector<unsigned char> palette;    // BGRA quads
+    vector<unsigned char> row;        // one file row
+    uint8_t palGray[256];
+    uint16_t bgrW[3];
+};
 
+// open_bmp_rows(in, path, gray, b): parse the headers and palette; false (with a message) if unsupported.
+static bool open_bmp_rows(istream& in, const string& path, bool gray, BmpRows& b) {
     // BITMAPFILEHEADER (14 bytes)
     char sigB = 0, sigM = 0;
     in.read(&sigB, 1); in.read(&sigM, 1);            // 'B','M' => 識別碼
     if (sigB != 'B' || sigM != 'M') {
-        cerr << "Not a BMP: " << path << "\n"; return img;
+        cerr << "Not a BMP: " << path << "\n"; return false;
     }
     (void) rd_u32(in);                                // file size (unused)
     (void) rd_u16(in); (void) rd_u16(in);            // reserved
@@ -137,7 +390,7 @@ static Image load_bmp(const string& path) {
 
     // DIB header (assume BITMAPINFOHEADER >= 40 bytes)
     uint32_t dibSize = rd_u32(in);
-    if (dibSize < 40) { std::cerr << "Unsupported BMP DIB size\n"; return img; }
+    if (dibSize < 40) { std::cerr << "Unsupported BMP DIB size\n"; return false; }
 
     int32_t  width  = rd_s32(in);
     int32_t  height = rd_s32(in);                     // <0 => top-down
@@ -152,15 +405,17 @@ static Image load_bmp(const string& path) {
 
     if (planes != 1 || (bpp != 24 && bpp != 8) || comp != 0) {
         std::cerr << "BMP unsupported (bpp=" << bpp << ", comp=" << comp << ")\n";
-        return img;
+        return false;
     }
 
     // We will output RGB (c=3) for both 24-bit and 8-bit indexed
-    const int W = width;
-    const int H = abs(height);
-    const bool topDown = (height < 0);
-    img.w = W; img.h = H; img.c = 3;
-    img.data.assign((size_t)W * H * 3, 0);
+    b.w = width;
+    b.h = abs(height);
+    b.topDown = (height < 0);
+    b.gray = gray;
+    b.c = gray ? 1 : 3;
+    b.bpp = bpp;
+    b.offBits = (streamoff)offBits;
 
     // Skip to palette or pixels
     // We have read 14 + 40 = 54 bytes so far; if dibSize > 40, skip the rest
@@ -168,49 +423,80 @@ static Image load_bmp(const string& path) {
     else in.seekg(54, ios::beg);
 
     // Palette for 8-bit
-    vector<unsigned char> palette; // stored as BGRA quads
     if (bpp == 8) {
         uint32_t numColors = clrUsed ? clrUsed : 256;
-        palette.resize((size_t)numColors * 4u);
-        in.read((char*)palette.data(), (streamsize)palette.size());
+        b.palette.resize((size_t)numColors * 4u);
+        in.read((char*)b.palette.data(), (streamsize)b.palette.size());
     }
 
     // Ensure we're at pixel array start (offBits)
-    in.seekg((streamoff)offBits, ios::beg);
-    if (!in) { cerr << "BMP seek failed\n"; img.data.clear(); return img; }
+    in.seekg(b.offBits, ios::beg);
+    if (!in) { cerr << "BMP seek failed\n"; return false; }
 
-    const int srcRow = bmp_row_size_bytes(bpp, W);
+    b.rowBytes = bmp_row_size_bytes(bpp, b.w);
+    b.row.resize(b.rowBytes);
 
-    vector<unsigned char> row(srcRow);
+    const uint16_t* lw = kLumaW[static_cast<int>(g_luma_weights)];
+    b.bgrW[0] = lw[2]; b.bgrW[1] = lw[1]; b.bgrW[2] = lw[0];
+    for (int i = 0; i < 256; ++i) {
+        const unsigned char* q = (size_t)i * 4u < b.palette.size() ? &b.palette[(size_t)i * 4u] : nullptr;
+        b.palGray[i] = q ? static_cast<uint8_t>((b.bgrW[0] * q[0] + b.bgrW[1] * q[1] + b.bgrW[2] * q[2] + 128u) >> 8)
+                         : (b.palette.empty() ? static_cast<uint8_t>(i) : 0);
+    }
+    return true;
+}
 
-    for (int y = 0; y < H; ++y) {
-        // Source row order: bottom-up if height>0, else top-down
-        int srcY = topDown ? y : (H - 1 - y);
-        streamoff pos = (streamoff)offBits + (streamoff)srcRow * srcY;
-        //move to row start
-        in.seekg(pos, ios::beg);
-        in.read((char*)row.data(), srcRow);
-        if (!in) { cerr << "BMP truncated row\n"; img.data.clear(); return img; }
+// read_bmp_row(in, b, y, dst): decode image row y (top = 0) into dst (w*c bytes).
+static bool read_bmp_row(istream& in, BmpRows& b, int y, uint8_t* dst) {
+    const int W = b.w;
+    // Source row order: bottom-up if height>0, else top-down
+    int srcY = b.topDown ? y : (b.h - 1 - y);
+    streamoff pos = b.offBits + (streamoff)b.rowBytes * srcY;
+    //move to row start
+    in.seekg(pos, ios::beg);
+    in.read((char*)b.row.data(), b.rowBytes);
+    if (!in) return false;
+    const vector<unsigned char>& row = b.row;
 
-        for (int x = 0; x < W; ++x) {
-            unsigned char r=0,g=0,b=0;
-            if (bpp == 24) {
-                const unsigned char* p = &row[x * 3];
-                b = p[0]; g = p[1]; r = p[2]; // BGR in file
-            } else { // 8-bit indexed
-                unsigned char idx = row[x];
-                if (!palette.empty()) {
-                    const unsigned char* q = &palette[(size_t)idx * 4u]; // BGRA
-                    b = q[0]; g = q[1]; r = q[2];
-                } else {
-                    // No palette declared: treat index as gray
-                    r = g = b = idx;
-                }
+    if (b.gray) {
+        if (b.bpp == 24) gray_row(row.data(), dst, (size_t)W, b.bgrW);
+        else for (int x = 0; x < W; ++x) dst[x] = b.palGray[row[x]];
+        return true;
+    }
+    for (int x = 0; x < W; ++x) {
+        unsigned char r=0,g=0,bl=0;
+        if (b.bpp == 24) {
+            const unsigned char* p = &row[x * 3];
+            bl = p[0]; g = p[1]; r = p[2]; // BGR in file
+        } else { // 8-bit indexed
+            unsigned char idx = row[x];
+            if (!b.palette.empty()) {
+                const unsigned char* q = &b.palette[(size_t)idx * 4u]; // BGRA
+                bl = q[0]; g = q[1]; r = q[2];
+            } else {
+                // No palette declared: treat index as gray
+                r = g = bl = idx;
             }
-            size_t di = ((size_t)y * W + x) * 3;
-            img.data[di+0] = r;
-            img.data[di+1] = g;
-            img.data[di+2] = b;
+        }
+        dst[x*3+0] = r;
+        dst[x*3+1] = g;
+        dst[x*3+2] = bl;
+    }
+    return true;
+}
+
+// load_bmp(): whole image through BmpRows (see above for the supported formats).
+static Image load_bmp(const string& path, bool gray) {
+    Image img;
+    ifstream in(path, ios::binary);
+    if (!in) { cerr << "Cannot open BMP " << path << "\n"; return img; }
+    BmpRows b;
+    if (!open_bmp_rows(in, path, gray, b)) return img;
+    img.w = b.w; img.h = b.h; img.c = b.c;
+    img.data.assign((size_t)b.w * b.h * img.c, 0);
+    for (int y = 0; y < b.h; ++y) {
+        if (!read_bmp_row(in, b, y, &img.data[(size_t)y * b.w * img.c])) {
+            cerr << "BMP truncated row\n"; img.data.clear(); return img;
         }
     }
     return img;
@@ -222,10 +508,229 @@ static inline uint8_t clamp_u8f(float v) {
     return static_cast<uint8_t>(lround(v));
 }
 
+// store_sample(dst, v): clamp v to the sample range and round (8- and 16-bit samples)
+static inline void store_sample(uint8_t& dst, float v) { dst = clamp_u8f(v); }
+static inline void store_sample(uint16_t& dst, float v) {
+    if (v < 0.f) v = 0.f;
+    if (v > 65535.f) v = 65535.f;
+    dst = static_cast<uint16_t>(lround(v));
+}
+
+// clamp_val(v, lo, hi): local clamp for pre-C++17 compilers.
+// Also include <cstring> for std::memcpy; <cctype> for std::tolower.
+template <typename T>
+static inline T clamp_val(T v, T lo, T hi) {
+    if (v < lo) return lo;
+    if (v > hi) return hi;
+    return v;
+}
+
+// --------------------- Linear light (sRGB) ---------------------
+// BMP bytes are sRGB-encoded; averaging or powering them directly darkens mid-tones.
+// srgb_decode/encode are the exact IEC 61966-2-1 curves on 0..1 values. The per-pixel
+// conversions go through tables instead: 256 -> 16-bit linear, and 65536 -> 8-bit back.
+static inline float srgb_decode(float c) {
+    return c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+}
+static inline float srgb_encode(float l) {
+    return l <= 0.0031308f ? 12.92f * l : 1.055f * pow(l, 1.0f / 2.4f) - 0.055f;
+}
+
+struct SrgbTables {
+    uint16_t to_linear[256];
+    vector<uint8_t> to_srgb;      // 65536 entries (64 KB, stays in L2)
+    SrgbTables() : to_srgb(65536) {
+        for (int i = 0; i < 256; ++i)
+            to_linear[i] = static_cast<uint16_t>(lround(srgb_decode(i / 255.0f) * 65535.0f));
+        for (int l = 0; l < 65536; ++l)
+            to_srgb[l] = clamp_u8f(srgb_encode(l / 65535.0f) * 255.0f);
+    }
+};
+
+// srgb_tables(): built on first use
+static const SrgbTables& srgb_tables() {
+    static const SrgbTables t;
+    return t;
+}
+
+// srgb_to_linear(in): 8-bit sRGB -> 16-bit linear light (one table lookup per sample)
+static Image16 srgb_to_linear(const Image& in) {
+    const uint16_t* lut = srgb_tables().to_linear;
+    Image16 out; out.w = in.w; out.h = in.h; out.c = in.c;
+    out.data.resize(in.data.size());
+    const size_t rowN = static_cast<size_t>(in.w) * in.c;
+    parallel_rows(in.h, [&](int y0, int y1) {
+        for (size_t i = rowN * y0; i < rowN * y1; ++i) out.data[i] = lut[in.data[i]];
+    });
+    return out;
+}
+
+// linear_to_srgb(in): 16-bit linear light -> 8-bit sRGB (one table lookup per sample)
+static Image linear_to_srgb(const Image16& in) {
+    const uint8_t* lut = srgb_tables().to_srgb.data();
+    Image out; out.w = in.w; out.h = in.h; out.c = in.c;
+    out.data.resize(in.data.size());
+    const size_t rowN = static_cast<size_t>(in.w) * in.c;
+    parallel_rows(in.h, [&](int y0, int y1) {
+        for (size_t i = rowN * y0; i < rowN * y1; ++i) out.data[i] = lut[in.data[i]];
+    });
+    return out;
+}
+
+// --------------------- Fast math (log2 / exp2 / pow) ---------------------
+// Used where a 256-entry LUT does not apply (16-bit and float samples).
+//   fast_log2(x), x > 0: x = m * 2^e with m in [sqrt(1/2), sqrt(2)), u = (m-1)/(m+1),
+//     log2(m) = (2/ln2) * (u + u^3/3 + u^5/5 + u^7/7)   (series truncation < 5e-8 since |u| < 0.172)
+//   fast_exp2(x): x = i + f with i = round(x), f in [-1/2, 1/2],
+//     2^f = sum_{k=0..6} (f ln2)^k / k!                (truncation < 1.2e-7 relative)
+//   fast_pow(x, y) = fast_exp2(y * fast_log2(x)); x <= 0 gives 0 (y > 0), 1 (y == 0), +huge (y < 0).
+// Error against std::log2 / std::exp2 / std::pow (double), checked by `main selftest` (run_selftest):
+//   fast_log2, x in [2^-16, 1]: abs <= kFastLog2MaxAbs;  fast_exp2, x in [-16, 0]: rel <= kFastExp2MaxRel;
+//   fast_pow, x in [2^-16, 1], y in [0.1, 10]: rel <= kFastPowMaxRel.
+//   16-bit gamma/log results stay within 1 LSB of the rounded std::pow / std::log2 value.
+// The SSE2 versions do the same arithmetic 4 lanes at a time.
+static const double kFastLog2MaxAbs = 6e-7, kFastExp2MaxRel = 2.5e-7, kFastPowMaxRel = 6.5e-6;
+static const float kLog2Series[4] = {
+    2.0f / 0.69314718f, 2.0f / (3.0f * 0.69314718f), 2.0f / (5.0f * 0.69314718f), 2.0f / (7.0f * 0.69314718f)
+};
+static const float kExp2Taylor[7] = {
+    1.0f, 0.69314718f, 0.24022651f, 0.05550411f, 0.00961813f, 0.00133336f, 0.00015403f
+};
+
+static inline float fast_log2(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, 4);
+    int e = static_cast<int>(bits >> 23) - 127;
+    bits = (bits & 0x007FFFFFu) | 0x3F800000u;
+    float m;
+    memcpy(&m, &bits, 4);
+    if (m > 1.41421356f) { m *= 0.5f; ++e; }
+    const float u = (m - 1.0f) / (m + 1.0f), u2 = u * u;
+    const float p = u * (kLog2Series[0] + u2 * (kLog2Series[1] + u2 * (kLog2Series[2] + u2 * kLog2Series[3])));
+    return static_cast<float>(e) + p;
+}
+
+static inline float fast_exp2(float x) {
+    x = clamp_val(x, -126.0f, 127.0f);
+    const float fi = nearbyintf(x);
+    const float f = x - fi;
+    float p = kExp2Taylor[6];
+    for (int k = 5; k >= 0; --k) p = p * f + kExp2Taylor[k];
+    const uint32_t bits = static_cast<uint32_t>(static_cast<int>(fi) + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, 4);
+    return p * scale;
+}
+
+// pow_zero(y): value of x^y at x == 0 (see fast_pow)
+static inline float pow_zero(float y) { return y > 0.f ? 0.f : (y == 0.f ? 1.f : 3.0e38f); }
+
+static inline float fast_pow(float x, float y) {
+    return x > 0.f ? fast_exp2(y * fast_log2(x)) : pow_zero(y);
+}
+
+#if defined(__SSE2__)
+static inline __m128 fast_log2_ps(__m128 x) {
+    const __m128i xi = _mm_castps_si128(x);
+    __m128i e = _mm_sub_epi32(_mm_srli_epi32(xi, 23), _mm_set1_epi32(127));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(xi, _mm_set1_epi32(0x007FFFFF)),
+                                             _mm_set1_epi32(0x3F800000)));
+    const __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))));   // m/2 where big
+    e = _mm_sub_epi32(e, _mm_castps_si128(big));                            // e+1 where big
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 u = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    const __m128 u2 = _mm_mul_ps(u, u);
+    __m128 p = _mm_set1_ps(kLog2Series[3]);
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(kLog2Series[2]));
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(kLog2Series[1]));
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(kLog2Series[0]));
+    return _mm_add_ps(_mm_cvtepi32_ps(e), _mm_mul_ps(p, u));
+}
+
+static inline __m128 fast_exp2_ps(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+    const __m128i i = _mm_cvtps_epi32(x);                 // round to nearest
+    const __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+    __m128 p = _mm_set1_ps(kExp2Taylor[6]);
+    for (int k = 5; k >= 0; --k) p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(kExp2Taylor[k]));
+    const __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+    return _mm_mul_ps(p, scale);
+}
+
+static inline __m128 fast_pow_ps(__m128 x, float y) {
+    const __m128 r = fast_exp2_ps(_mm_mul_ps(_mm_set1_ps(y), fast_log2_ps(x)));
+    const __m128 pos = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    return _mm_or_ps(_mm_and_ps(pos, r), _mm_andnot_ps(pos, _mm_set1_ps(pow_zero(y))));
+}
+#endif
+
+// pow_inplace(v, n, y): v[i] = v[i]^y
+static void pow_inplace(float* v, size_t n, float y) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) _mm_storeu_ps(v + i, fast_pow_ps(_mm_loadu_ps(v + i), y));
+#endif
+    for (; i < n; ++i) v[i] = fast_pow(v[i], y);
+}
+
+// log2_1p_inplace(v, n, k, scale): v[i] = scale * log2(1 + k * v[i])   (v >= 0)
+static void log2_1p_inplace(float* v, size_t n, float k, float scale) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vk = _mm_set1_ps(k), vs = _mm_set1_ps(scale), one = _mm_set1_ps(1.0f);
+    for (; i + 4 <= n; i += 4) {
+        const __m128 a = _mm_add_ps(one, _mm_mul_ps(vk, _mm_loadu_ps(v + i)));
+        _mm_storeu_ps(v + i, _mm_mul_ps(vs, fast_log2_ps(a)));
+    }
+#endif
+    for (; i < n; ++i) v[i] = scale * fast_log2(1.0f + k * v[i]);
+}
+
 // --------------------- Point operations ---------------------
 // negative: v -> 255 - v  (can use C-style pointer loop or 256-entry LUT)
 // log:      s = (255/log(256))*log(1+v)      (use 256-entry LUT to avoid per-pixel log)
 // gamma:    s = 255 * (v/255)^gamma          (use 256-entry LUT; apply per byte)
+// LUTs are applied with apply_lut8(), which reads the source and writes the result in one pass.
+// apply_lut8(src, dst, lut): dst = lut[src] on every byte, rows split across threads.
+// dst is sized to match src; dst may be src itself (in-place).
+static void apply_lut8(const Image& src, Image& dst, const uint8_t lut[256]) {
+    if (&dst != &src) {
+        dst.w = src.w; dst.h = src.h; dst.c = src.c;
+        dst.data.resize(src.data.size());
+    }
+    const size_t rowBytes = static_cast<size_t>(src.w) * src.c;
+    parallel_rows(src.h, [&](int y0, int y1) {
+        const uint8_t* p = src.data.data() + rowBytes * y0;
+        const uint8_t* e = src.data.data() + rowBytes * y1;
+        uint8_t* q = dst.data.data() + rowBytes * y0;
+        // 4 independent lookups per iteration keep the load ports busy
+        for (; p + 4 <= e; p += 4, q += 4) {
+            const uint8_t a = lut[p[0]], b = lut[p[1]], c = lut[p[2]], d = lut[p[3]];
+            q[0] = a; q[1] = b; q[2] = c; q[3] = d;
+        }
+        for (; p < e; ++p, ++q) *q = lut[*p];
+    });
+}
+
+// apply_lut8_channels(src, dst, luts): per-channel variant, luts[k] is used for channel k.
+static void apply_lut8_channels(const Image& src, Image& dst, const uint8_t* const* luts) {
+    if (src.c == 1) { apply_lut8(src, dst, luts[0]); return; }
+    if (&dst != &src) {
+        dst.w = src.w; dst.h = src.h; dst.c = src.c;
+        dst.data.resize(src.data.size());
+    }
+    const int c = src.c;
+    const size_t rowBytes = static_cast<size_t>(src.w) * c;
+    parallel_rows(src.h, [&](int y0, int y1) {
+        const uint8_t* p = src.data.data() + rowBytes * y0;
+        const uint8_t* e = src.data.data() + rowBytes * y1;
+        uint8_t* q = dst.data.data() + rowBytes * y0;
+        for (; p < e; p += c, q += c)
+            for (int k = 0; k < c; ++k) q[k] = luts[k][p[k]];
+    });
+}
+
 static Image op_negative(const Image& in) {
     Image out = in;
     uint8_t* p = out.data.data();
@@ -237,223 +742,2913 @@ static Image op_negative(const Image& in) {
     return out;
 }
 
-static Image op_log(const Image& in) {
+// linear=true runs the curve in linear light: v is decoded from sRGB first and the result is
+// re-encoded, all inside the 256-entry LUT, so it costs nothing extra per pixel.
+static Image op_log(const Image& in, bool linear = false) {
     // s = c * log(1 + r), r in [0,255], c = 255 / log(256)
-    Image out = in;
+    Image out;
     // Precompute once
     uint8_t log_lut[256];
     {
         const float c = 255.0f / log(256.0f);
         for (int i = 0; i < 256; ++i) {
-            float s = c * log(1.0f + float(i));
+            const float r = linear ? srgb_decode(i / 255.0f) * 255.0f : float(i);
+            float s = c * log(1.0f + r);
+            if (linear) s = srgb_encode(s / 255.0f) * 255.0f;
             log_lut[i] = clamp_u8f(s);
         }
     }
 
-    for (size_t idx = 0; idx < out.data.size(); ++idx) {
-        out.data[idx] = log_lut[out.data[idx]];
-    }
+    apply_lut8(in, out, log_lut);
     return out;
 }
 
-static Image op_gamma(const Image& in, float gamma) {
+static Image op_gamma(const Image& in, float gamma, bool linear = false) {
     uint8_t lut[256];
     for (int i = 0; i < 256; ++i) {
         float r = static_cast<float>(i) / 255.0f;
-        float s = std::pow(r, gamma) * 255.0f;
+        if (linear) r = srgb_decode(r);
+        float s = std::pow(r, gamma);
+        s = (linear ? srgb_encode(s) : s) * 255.0f;
         if (s < 0.0f) s = 0.0f;
         if (s > 255.0f) s = 255.0f;
         lut[i] = static_cast<uint8_t>(std::lround(s));
     }
 
-    Image out = in;
-    for (size_t idx = 0; idx < out.data.size(); ++idx) {
-        out.data[idx] = lut[out.data[idx]];
-    }
+    Image out;
+    apply_lut8(in, out, lut);
     return out;
 }
 
 
-// --------------------- Resizing ---------------------
-// clamp_val(v, lo, hi): local clamp for pre-C++17 compilers.
-// Also include <cstring> for std::memcpy; <cctype> for std::tolower.
-template <typename T>
-static inline T clamp_val(T v, T lo, T hi) {
-    if (v < lo) return lo;
-    if (v > hi) return hi;
-    return v;
+// --------------------- High bit depth point ops ---------------------
+// 16-bit and float images (float samples are nominally 0..1). Rows are converted to 0..1
+// floats in a per-thread buffer, transformed with the vector fast-math kernels, and stored
+// back with clamping/rounding. No tables: a 16-bit LUT per gamma would be 128 KB and
+// float input has no finite table at all.
+template <typename T> struct SampleRange;
+template <> struct SampleRange<uint16_t> { static constexpr float max = 65535.f; };
+template <> struct SampleRange<float>    { static constexpr float max = 1.f; };
+
+static inline void load_unit(const uint16_t* s, float* d, size_t n) {
+    for (size_t i = 0; i < n; ++i) d[i] = s[i] * (1.0f / 65535.0f);
 }
-//--------------------- NN resize ---------------------
-// resize_nearest(in, newW, newH):
-// Pixel-centered mapping: fx=(x+0.5)*sx - 0.5, fy=(y+0.5)*sy - 0.5.
-// Round to nearest source index; clamp at borders.
-// Very fast; produces blockiness when upscaling.
-static Image resize_nearest(const Image& in, int newW, int newH) {
-    Image out; out.w = newW; out.h = newH; out.c = in.c;
-    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
-    const double sx = static_cast<double>(in.w) / newW;
-    const double sy = static_cast<double>(in.h) / newH;
+static inline void load_unit(const float* s, float* d, size_t n) { memcpy(d, s, n * sizeof(float)); }
+static inline void store_unit(const float* s, uint16_t* d, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        const float v = clamp_val(s[i] * 65535.0f, 0.0f, 65535.0f);
+        d[i] = static_cast<uint16_t>(v + 0.5f);
+    }
+}
+static inline void store_unit(const float* s, float* d, size_t n) { memcpy(d, s, n * sizeof(float)); }
 
-    for (int y = 0; y < newH; ++y) {
-        int syi = (int)floor((y + 0.5) * sy - 0.5);
-        syi = clamp_val(syi, 0, in.h - 1);
-        for (int x = 0; x < newW; ++x) {
-            int sxi = (int)floor((x + 0.5) * sx - 0.5);
-            sxi = clamp_val(sxi, 0, in.w - 1);
-            const uint8_t* sp = &in.data[(static_cast<size_t>(syi)*in.w + sxi)*in.c];
-            uint8_t* dp = &out.data[(static_cast<size_t>(y)*newW + x)*out.c];
-            for (int ch = 0; ch < out.c; ++ch) dp[ch] = sp[ch];
+// map_unit_rows(in, fn): out = fn applied to every row as 0..1 floats (fn(buf, n) in place)
+template <typename T, typename F>
+static ImageT<T> map_unit_rows(const ImageT<T>& in, F fn) {
+    ImageT<T> out; out.w = in.w; out.h = in.h; out.c = in.c;
+    out.data.resize(in.data.size());
+    const size_t rowN = static_cast<size_t>(in.w) * in.c;
+    parallel_rows(in.h, [&](int y0, int y1) {
+        vector<float> buf(rowN);
+        for (int y = y0; y < y1; ++y) {
+            load_unit(&in.data[rowN * y], buf.data(), rowN);
+            fn(buf.data(), rowN);
+            store_unit(buf.data(), &out.data[rowN * y], rowN);
         }
-    }
+    });
     return out;
 }
 
-//--------------------- Bilinear resize ---------------------
-// resize_bilinear(in, newW, newH):
-// Let x0=floor(fx), x1=x0+1, wx=fx-x0 (same for y).
-// v0=(1-wx)*F(x0,y0) + wx*F(x1,y0)
-// v1=(1-wx)*F(x0,y1) + wx*F(x1,y1)
-// v =(1-wy)*v0       + wy*v1
-// Weights sum to 1; clamp indices; per-channel blend then clamp_u8f().
-static Image resize_bilinear(const Image& in, int newW, int newH) {
-    Image out; out.w = newW; out.h = newH; out.c = in.c;
-    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
-    const double scaleX = static_cast<double>(in.w) / newW;
-    const double scaleY = static_cast<double>(in.h) / newH;
+// op_gamma_hd(in, gamma): s = v^gamma on the 0..1 scale
+template <typename T>
+static ImageT<T> op_gamma_hd(const ImageT<T>& in, float gamma) {
+    return map_unit_rows(in, [gamma](float* v, size_t n) { pow_inplace(v, n, gamma); });
+}
 
-    for (int y = 0; y < newH; ++y) {
-        double fy = (y + 0.5) * scaleY - 0.5;
-        int y0 = static_cast<int>(floor(fy));
-        int y1 = y0 + 1;
-        double wy = fy - y0;
-        y0 = clamp_val(y0, 0, in.h - 1);
-        y1 = clamp_val(y1, 0, in.h - 1);
+// op_log_hd(in): the 8-bit log curve carried to the sample range,
+//   16-bit: s = log2(1 + 65535 v) / 16       float: s = log2(1 + 255 v) / 8   (v, s in 0..1)
+template <typename T>
+static ImageT<T> op_log_hd(const ImageT<T>& in) {
+    const float k = (SampleRange<T>::max == 1.f) ? 255.0f : 65535.0f;
+    const float scale = 1.0f / log2(1.0f + k);
+    return map_unit_rows(in, [k, scale](float* v, size_t n) { log2_1p_inplace(v, n, k, scale); });
+}
 
-        for (int x = 0; x < newW; ++x) {
-            double fx = (x + 0.5) * scaleX - 0.5;
-            int x0 = static_cast<int>(floor(fx));
-            int x1 = x0 + 1;
-            double wx = fx - x0;
-            x0 = clamp_val(x0, 0, in.w - 1);
-            x1 = clamp_val(x1, 0, in.w - 1);
+// --------------------- Color LUT (.cube) ---------------------
+// CubeLut: Adobe/Resolve .cube table (values are floats, nominally 0..1).
+//   LUT_1D_SIZE N          -> N rows "r g b": per-channel curves (applied first, as a shaper)
+//   LUT_3D_SIZE N          -> N^3 rows "r g b", red index varies fastest, then green, then blue
+//   DOMAIN_MIN / DOMAIN_MAX -> input range of the table(s) (default 0..1)
+//   LUT_1D_INPUT_RANGE / LUT_3D_INPUT_RANGE -> per-table range (Resolve style)
+// 3D entries are kept as RGB + pad (4 floats), so one SSE load fetches a lattice point.
+struct CubeLut {
+    int n1 = 0, n3 = 0;
+    float d1min[3] = {0.f, 0.f, 0.f}, d1max[3] = {1.f, 1.f, 1.f};
+    float d3min[3] = {0.f, 0.f, 0.f}, d3max[3] = {1.f, 1.f, 1.f};
+    vector<float> lut1d;   // n1 * 3
+    vector<float> lut3d;   // n3^3 * 4
+    bool empty() const { return n1 == 0 && n3 == 0; }
+};
 
-            for (int ch = 0; ch < out.c; ++ch) {
-                const int idx00 = ((y0*in.w + x0)*in.c + ch);
-                const int idx10 = ((y0*in.w + x1)*in.c + ch);
-                const int idx01 = ((y1*in.w + x0)*in.c + ch);
-                const int idx11 = ((y1*in.w + x1)*in.c + ch);
+enum class LutInterp { Tetrahedral, Trilinear };
 
-                double v00 = in.data[idx00];
-                double v10 = in.data[idx10];
-                double v01 = in.data[idx01];
-                double v11 = in.data[idx11];
+// load_cube(path):
+// Parses keywords and data rows; unknown keywords are ignored.
+// Returns an empty CubeLut (and prints why) on any error.
+static CubeLut load_cube(const string& path) {
+    CubeLut lut;
+    ifstream in(path);
+    if (!in) { cerr << "Cannot open LUT " << path << "\n"; return lut; }
 
-                double v0 = v00 * (1.0 - wx) + v10 * wx;
-                double v1 = v01 * (1.0 - wx) + v11 * wx;
-                double v  = v0  * (1.0 - wy) + v1  * wy;
+    vector<float> rows;   // every "r g b" triple in file order
+    string line;
+    while (getline(in, line)) {
+        const size_t hash = line.find('#');
+        if (hash != string::npos) line.resize(hash);
+        istringstream ls(line);
+        string key;
+        if (!(ls >> key)) continue;
 
-                out.data[(static_cast<size_t>(y)*newW + x)*out.c + ch] = clamp_u8f(static_cast<float>(v));
-            }
+        if (key == "LUT_1D_SIZE") { ls >> lut.n1; continue; }
+        if (key == "LUT_3D_SIZE") { ls >> lut.n3; continue; }
+        if (key == "DOMAIN_MIN") {
+            ls >> lut.d1min[0] >> lut.d1min[1] >> lut.d1min[2];
+            for (int k = 0; k < 3; ++k) lut.d3min[k] = lut.d1min[k];
+            continue;
+        }
+        if (key == "DOMAIN_MAX") {
+            ls >> lut.d1max[0] >> lut.d1max[1] >> lut.d1max[2];
+            for (int k = 0; k < 3; ++k) lut.d3max[k] = lut.d1max[k];
+            continue;
+        }
+        if (key == "LUT_1D_INPUT_RANGE" || key == "LUT_3D_INPUT_RANGE") {
+            float lo = 0.f, hi = 1.f;
+            ls >> lo >> hi;
+            float* mn = (key[4] == '1') ? lut.d1min : lut.d3min;
+            float* mx = (key[4] == '1') ? lut.d1max : lut.d3max;
+            for (int k = 0; k < 3; ++k) { mn[k] = lo; mx[k] = hi; }
+            continue;
+        }
+
+        // Anything that does not start with a number is a keyword we do not use (TITLE, ...)
+        char* end = nullptr;
+        strtof(key.c_str(), &end);
+        if (end == key.c_str()) continue;
+
+        istringstream ds(line);
+        float r, g, b;
+        if (!(ds >> r >> g >> b)) { cerr << "Bad LUT row: " << line << "\n"; return CubeLut{}; }
+        rows.push_back(r); rows.push_back(g); rows.push_back(b);
+    }
+
+    if (lut.n1 == 1 || lut.n3 == 1 || lut.n1 < 0 || lut.n3 < 0 || lut.n3 > 256 || lut.empty()) {
+        cerr << "LUT size unsupported (1D=" << lut.n1 << ", 3D=" << lut.n3 << ")\n";
+        return CubeLut{};
+    }
+    const size_t n3cube = static_cast<size_t>(lut.n3) * lut.n3 * lut.n3;
+    if (rows.size() != (static_cast<size_t>(lut.n1) + n3cube) * 3) {
+        cerr << "LUT row count mismatch in " << path << "\n";
+        return CubeLut{};
+    }
+    for (int k = 0; k < 3; ++k) {
+        if (!(lut.d1max[k] > lut.d1min[k]) || !(lut.d3max[k] > lut.d3min[k])) {
+            cerr << "LUT domain is empty\n";
+            return CubeLut{};
         }
     }
-    return out;
+
+    // Resolve writes the 1D shaper block before the 3D block
+    lut.lut1d.assign(rows.begin(), rows.begin() + static_cast<size_t>(lut.n1) * 3);
+    lut.lut3d.assign(n3cube * 4, 0.f);
+    const float* src = rows.data() + static_cast<size_t>(lut.n1) * 3;
+    for (size_t i = 0; i < n3cube; ++i) {
+        lut.lut3d[i*4 + 0] = src[i*3 + 0];
+        lut.lut3d[i*4 + 1] = src[i*3 + 1];
+        lut.lut3d[i*4 + 2] = src[i*3 + 2];
+    }
+    return lut;
 }
-// --------------------- PNM (PGM/PPM) ---------------------
-static bool write_pnm(const string& path, const Image& img) {
-    if (img.empty()) return false;
-    const bool isGray = (img.c == 1);
-    ofstream out(path, ios::binary);
-    if (!out) { cerr << "Cannot write " << path << "\n"; return false; }
-    out << (isGray ? "P5\n" : "P6\n")
-        << img.w << " " << img.h << "\n"
-        << 255 << "\n";
-    out.write(reinterpret_cast<const char*>(img.data.data()), img.data.size());
-    return static_cast<bool>(out);
+
+// lut_sample_1d(lut, ch, x): linear interpolation of the 1D curve of channel ch at input x.
+static float lut_sample_1d(const CubeLut& lut, int ch, float x) {
+    float t = (x - lut.d1min[ch]) / (lut.d1max[ch] - lut.d1min[ch]) * (lut.n1 - 1);
+    t = clamp_val(t, 0.f, static_cast<float>(lut.n1 - 1));
+    int i = min(static_cast<int>(t), lut.n1 - 2);
+    float f = t - i;
+    const float a = lut.lut1d[static_cast<size_t>(i) * 3 + ch];
+    const float b = lut.lut1d[static_cast<size_t>(i + 1) * 3 + ch];
+    return a + (b - a) * f;
 }
-// ------- BMP writer (BI_RGB; 24-bit for RGB, 8-bit paletted for gray) -------
-static bool write_bmp(const std::string& path, const Image& img) {
-    if (img.empty()) return false;
 
-    const int W = img.w, H = img.h;
-    const bool isGray = (img.c == 1);
+// Per-pixel 3D interpolation. c000 points at the lower lattice corner, sr/sg/sb are the
+// float strides of one step along r/g/b, f* are the fractional positions in [0,1].
+// Tables are pre-scaled by 255, so the result is already in byte range.
+// Tetrahedral: pick the tetrahedron by ordering fr/fg/fb (6 cases), then
+//   out = (1-f1)*c000 + (f1-f2)*cA + (f2-f3)*cB + f3*c111
+// where cA/cB are the corners reached by stepping along the largest, then second axis.
+static inline void tetra_pixel(const float* c000, int sr, int sg, int sb,
+                               float fr, float fg, float fb, uint8_t* dst) {
+    int s1, s2; float f1, f2, f3;
+    if (fr > fg) {
+        if (fg > fb)      { s1 = sr; s2 = sg; f1 = fr; f2 = fg; f3 = fb; }
+        else if (fr > fb) { s1 = sr; s2 = sb; f1 = fr; f2 = fb; f3 = fg; }
+        else              { s1 = sb; s2 = sr; f1 = fb; f2 = fr; f3 = fg; }
+    } else {
+        if (fb > fg)      { s1 = sb; s2 = sg; f1 = fb; f2 = fg; f3 = fr; }
+        else if (fb > fr) { s1 = sg; s2 = sb; f1 = fg; f2 = fb; f3 = fr; }
+        else              { s1 = sg; s2 = sr; f1 = fg; f2 = fr; f3 = fb; }
+    }
+    const float* cA   = c000 + s1;
+    const float* cB   = cA + s2;
+    const float* c111 = c000 + sr + sg + sb;
+#if defined(__SSE2__)
+    __m128 v = _mm_mul_ps(_mm_set1_ps(1.f - f1), _mm_loadu_ps(c000));
+    v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(f1 - f2), _mm_loadu_ps(cA)));
+    v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(f2 - f3), _mm_loadu_ps(cB)));
+    v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(f3),      _mm_loadu_ps(c111)));
+    __m128i q = _mm_cvtps_epi32(v);
+    q = _mm_packs_epi32(q, q);
+    q = _mm_packus_epi16(q, q);                      // saturates to 0..255
+    const uint32_t rgbx = static_cast<uint32_t>(_mm_cvtsi128_si32(q));
+    dst[0] = static_cast<uint8_t>(rgbx);
+    dst[1] = static_cast<uint8_t>(rgbx >> 8);
+    dst[2] = static_cast<uint8_t>(rgbx >> 16);
+#else
+    for (int k = 0; k < 3; ++k) {
+        float v = (1.f - f1) * c000[k] + (f1 - f2) * cA[k] + (f2 - f3) * cB[k] + f3 * c111[k];
+        dst[k] = clamp_u8f(v);
+    }
+#endif
+}
 
-    const int bpp = isGray ? 8 : 24;
-    const int rowSize = bmp_row_size_bytes(bpp, W);
-    const int pixelArraySize = rowSize * H;
+// Trilinear: weights are the products of the per-axis linear weights (8 corners).
+static inline void trilinear_pixel(const float* c000, int sr, int sg, int sb,
+                                   float fr, float fg, float fb, uint8_t* dst) {
+    const float* c[8] = {
+        c000,           c000 + sr,           c000 + sg,           c000 + sr + sg,
+        c000 + sb,      c000 + sr + sb,      c000 + sg + sb,      c000 + sr + sg + sb
+    };
+    const float gr = 1.f - fr, gg = 1.f - fg, gb = 1.f - fb;
+    const float w[8] = {
+        gr*gg*gb, fr*gg*gb, gr*fg*gb, fr*fg*gb,
+        gr*gg*fb, fr*gg*fb, gr*fg*fb, fr*fg*fb
+    };
+#if defined(__SSE2__)
+    __m128 v = _mm_mul_ps(_mm_set1_ps(w[0]), _mm_loadu_ps(c[0]));
+    for (int i = 1; i < 8; ++i) v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(w[i]), _mm_loadu_ps(c[i])));
+    __m128i q = _mm_cvtps_epi32(v);
+    q = _mm_packs_epi32(q, q);
+    q = _mm_packus_epi16(q, q);
+    const uint32_t rgbx = static_cast<uint32_t>(_mm_cvtsi128_si32(q));
+    dst[0] = static_cast<uint8_t>(rgbx);
+    dst[1] = static_cast<uint8_t>(rgbx >> 8);
+    dst[2] = static_cast<uint8_t>(rgbx >> 16);
+#else
+    for (int k = 0; k < 3; ++k) {
+        float v = 0.f;
+        for (int i = 0; i < 8; ++i) v += w[i] * c[i][k];
+        dst[k] = clamp_u8f(v);
+    }
+#endif
+}
 
-    // Headers
-    const uint32_t bfOffBits = 14 + 40 + (isGray ? 256 * 4 : 0); // file + DIB + palette
-    const uint32_t bfSize    = bfOffBits + pixelArraySize;
+// op_cube_lut(in, lut, interp):
+// 1D-only LUT  -> compiled to one 256-entry table per channel, applied with apply_lut8_channels().
+// 3D LUT       -> needs c=3. Each byte value is mapped once (through the 1D shaper, if any)
+//                 to a lattice offset + fraction, so the per-pixel work is just the blend.
+// Rows are processed in parallel bands.
+static Image op_cube_lut(const Image& in, const CubeLut& lut, LutInterp interp) {
+    if (in.empty() || lut.empty()) return Image{};
 
-    std::ofstream out(path, std::ios::binary);
-    if (!out) { std::cerr << "Cannot write " << path << "\n"; return false; }
+    // shaped[k][v]: channel k of input byte v after the 1D stage, in 0..1 units
+    vector<float> shaped(3 * 256);
+    for (int k = 0; k < 3; ++k) {
+        for (int v = 0; v < 256; ++v) {
+            const float x = v / 255.0f;
+            shaped[k*256 + v] = lut.n1 ? lut_sample_1d(lut, k, x) : x;
+        }
+    }
 
-    auto wr_u16 = [&](uint16_t v){ out.put((char)(v & 0xFF)); out.put((char)(v >> 8)); };
-    auto wr_u32 = [&](uint32_t v){
-        out.put((char)( v        & 0xFF));
-        out.put((char)((v >> 8 ) & 0xFF));
-        out.put((char)((v >> 16) & 0xFF));
-        out.put((char)((v >> 24) & 0xFF));
-    };
-    auto wr_s32 = [&](int32_t v){ wr_u32((uint32_t)v); };
+    if (lut.n3 == 0) {
+        uint8_t tab[3][256];
+        for (int k = 0; k < 3; ++k)
+            for (int v = 0; v < 256; ++v) tab[k][v] = clamp_u8f(shaped[k*256 + v] * 255.0f);
+        const uint8_t* luts[3] = { tab[0], tab[1], tab[2] };
+        Image out;
+        apply_lut8_channels(in, out, luts);
+        return out;
+    }
 
-    // BITMAPFILEHEADER (14)
-    out.put('B'); out.put('M');
-    wr_u32(bfSize);
-    wr_u16(0); wr_u16(0);     // reserved
-    wr_u32(bfOffBits);
+    if (in.c != 3) { cerr << "3D LUT needs an RGB (c=3) image\n"; return Image{}; }
 
-    // BITMAPINFOHEADER (40)
-    wr_u32(40);               // biSize
-    wr_s32(W);
-    wr_s32(H);                // positive -> bottom-up
-    wr_u16(1);                // planes
-    wr_u16((uint16_t)bpp);
-    wr_u32(0);                // BI_RGB
-    wr_u32(pixelArraySize);
-    wr_s32(2835);             // ~72 DPI (optional)
-    wr_s32(2835);
-    wr_u32(isGray ? 256u : 0u); // colors used
-    wr_u32(0);
+    const int n = lut.n3;
+    const int sr = 4, sg = 4 * n, sb = 4 * n * n;
+    vector<float> table(lut.lut3d);
+    for (float& t : table) t *= 255.0f;
 
-    // Palette for 8-bit (grayscale ramp, BGRA)
-    if (isGray) {
-        for (int i = 0; i < 256; ++i) {
-            unsigned char b = (unsigned char)i;
-            out.put((char)b); out.put((char)b); out.put((char)b); out.put((char)0);
+    // Per-channel byte -> (lattice offset in floats, fraction)
+    int   ofs[3][256];
+    float frac[3][256];
+    const int stride[3] = { sr, sg, sb };
+    for (int k = 0; k < 3; ++k) {
+        for (int v = 0; v < 256; ++v) {
+            float t = (shaped[k*256 + v] - lut.d3min[k]) / (lut.d3max[k] - lut.d3min[k]) * (n - 1);
+            t = clamp_val(t, 0.f, static_cast<float>(n - 1));
+            const int i = min(static_cast<int>(t), n - 2);
+            ofs[k][v]  = i * stride[k];
+            frac[k][v] = t - i;
         }
     }
 
-    // Pixel data (bottom-up)
-    std::vector<unsigned char> row(rowSize, 0);
-    for (int y = H - 1; y >= 0; --y) {           // write bottom row first
-        if (isGray) {
-            // indices directly from grayscale
-            const unsigned char* src = &img.data[(size_t)y * W];
-            std::memcpy(row.data(), src, (size_t)W);
-        } else {
-            // convert RGB -> BGR in file
-            const unsigned char* src = &img.data[(size_t)y * W * 3];
-            for (int x = 0; x < W; ++x) {
-                row[x*3 + 0] = src[x*3 + 2]; // B
-                row[x*3 + 1] = src[x*3 + 1]; // G
-                row[x*3 + 2] = src[x*3 + 0]; // R
+    Image out; out.w = in.w; out.h = in.h; out.c = 3;
+    out.data.resize(in.data.size());
+    const float* base = table.data();
+    parallel_rows(in.h, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const uint8_t* sp = &in.data[static_cast<size_t>(y) * in.w * 3];
+            uint8_t* dp = &out.data[static_cast<size_t>(y) * in.w * 3];
+            for (int x = 0; x < in.w; ++x, sp += 3, dp += 3) {
+                const uint8_t r = sp[0], g = sp[1], b = sp[2];
+                const float* c000 = base + ofs[0][r] + ofs[1][g] + ofs[2][b];
+                if (interp == LutInterp::Tetrahedral)
+                    tetra_pixel(c000, sr, sg, sb, frac[0][r], frac[1][g], frac[2][b], dp);
+                else
+                    trilinear_pixel(c000, sr, sg, sb, frac[0][r], frac[1][g], frac[2][b], dp);
+            }
+        }
+    });
+    return out;
+}
+
+
+// --------------------- Tone curves ---------------------
+// ToneCurve: control points (x, y) in 0..255 units, sorted by x. Outside [x0, xn] the curve
+// is flat at the end values. Evaluated piecewise-linearly or as a monotone cubic
+// (Fritsch-Carlson tangents: no overshoot between points, so monotone input stays monotone).
+// 16-bit images use the same units scaled by 65535/255.
+struct ToneCurve {
+    vector<float> x, y, m;   // m: Hermite tangents (spline only)
+    bool spline = false;
+    bool empty() const { return x.empty(); }
+};
+
+// finalize_curve(c): sort, validate (>= 2 points, distinct x) and compute spline tangents
+static bool finalize_curve(ToneCurve& c) {
+    const size_t n = c.x.size();
+    if (n < 2) { cerr << "Curve needs at least 2 points\n"; return false; }
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) { return c.x[a] < c.x[b]; });
+    vector<float> xs(n), ys(n);
+    for (size_t i = 0; i < n; ++i) { xs[i] = c.x[order[i]]; ys[i] = c.y[order[i]]; }
+    for (size_t i = 1; i < n; ++i) {
+        if (!(xs[i] > xs[i - 1])) { cerr << "Curve points need distinct x\n"; return false; }
+    }
+    c.x.swap(xs); c.y.swap(ys);
+
+    c.m.assign(n, 0.f);
+    if (c.spline) {
+        vector<float> d(n - 1);
+        for (size_t i = 0; i + 1 < n; ++i) d[i] = (c.y[i + 1] - c.y[i]) / (c.x[i + 1] - c.x[i]);
+        c.m[0] = d[0];
+        c.m[n - 1] = d[n - 2];
+        for (size_t i = 1; i + 1 < n; ++i) c.m[i] = (d[i - 1] * d[i] <= 0.f) ? 0.f : 0.5f * (d[i - 1] + d[i]);
+        for (size_t i = 0; i + 1 < n; ++i) {
+            if (d[i] == 0.f) { c.m[i] = c.m[i + 1] = 0.f; continue; }
+            const float a = c.m[i] / d[i], b = c.m[i + 1] / d[i];
+            const float r = a * a + b * b;
+            if (r > 9.f) {
+                const float t = 3.f / sqrt(r);
+                c.m[i] = t * a * d[i];
+                c.m[i + 1] = t * b * d[i];
             }
         }
-        out.write((const char*)row.data(), rowSize);
-        if (!out) { std::cerr << "BMP write row failed\n"; return false; }
     }
     return true;
 }
 
-// load_by_extension(path):
-//   .bmp      -> load_bmp()
-//   .raw      -> load_raw_grayscale(512,512)
-//   .jpg/.png -> not supported in stdlib build (print conversion hint)
+// parse_curve(spec, spline, c):
+// spec is "x:y,x:y,..." or "@file" (one "x y" or "x:y" pair per line, '#' comments).
+static bool parse_curve(const string& spec, bool spline, ToneCurve& c) {
+    c = ToneCurve{};
+    c.spline = spline;
+    string text = spec;
+    if (!spec.empty() && spec[0] == '@') {
+        ifstream in(spec.substr(1));
+        if (!in) { cerr << "Cannot open curve file " << spec.substr(1) << "\n"; return false; }
+        ostringstream all;
+        string line;
+        while (getline(in, line)) {
+            const size_t hash = line.find('#');
+            if (hash != string::npos) line.resize(hash);
+            all << line << ",";
+        }
+        text = all.str();
+    }
+    for (char& ch : text) if (ch == ':' || ch == ',' || ch == '\t') ch = ' ';
+    istringstream ss(text);
+    float px, py;
+    while (ss >> px) {
+        if (!(ss >> py)) { cerr << "Curve point without y value\n"; return false; }
+        if (px < 0.f || px > 255.f || py < 0.f || py > 255.f) { cerr << "Curve points must be in 0..255\n"; return false; }
+        c.x.push_back(px); c.y.push_back(py);
+    }
+    if (!ss.eof()) { cerr << "Bad curve spec '" << spec << "'\n"; return false; }
+    return finalize_curve(c);
+}
+
+// eval_curve(c, v): curve value at v (0..255 units)
+static float eval_curve(const ToneCurve& c, float v) {
+    if (v <= c.x.front()) return c.y.front();
+    if (v >= c.x.back())  return c.y.back();
+    const size_t i = static_cast<size_t>(upper_bound(c.x.begin(), c.x.end(), v) - c.x.begin()) - 1;
+    const float hseg = c.x[i + 1] - c.x[i];
+    const float t = (v - c.x[i]) / hseg;
+    if (!c.spline) return c.y[i] + (c.y[i + 1] - c.y[i]) * t;
+    const float t2 = t * t, t3 = t2 * t;
+    return (2*t3 - 3*t2 + 1) * c.y[i] + (t3 - 2*t2 + t) * hseg * c.m[i]
+         + (-2*t3 + 3*t2) * c.y[i + 1] + (t3 - t2) * hseg * c.m[i + 1];
+}
+
+// compile_curve_luts(master, chan, c, size, out):
+// out[k * size + i] = chan[k](master(i)) for sample value i (size 256 or 65536), in 0..size-1.
+// Empty curves are the identity, so master-only and channel-only curves both work.
+static void compile_curve_luts(const ToneCurve& master, const ToneCurve* chan, int c, int size,
+                               vector<float>& out) {
+    const float toUnits = 255.0f / (size - 1), fromUnits = (size - 1) / 255.0f;
+    out.resize(static_cast<size_t>(c) * size);
+    for (int i = 0; i < size; ++i) {
+        float v = i * toUnits;
+        if (!master.empty()) v = eval_curve(master, v);
+        for (int k = 0; k < c; ++k) {
+            const float vk = (chan && !chan[k].empty()) ? eval_curve(chan[k], v) : v;
+            out[static_cast<size_t>(k) * size + i] = clamp_val(vk * fromUnits, 0.0f, static_cast<float>(size - 1));
+        }
+    }
+}
+
+// apply_lut16(src, dst, luts): 16-bit per-channel table lookup (65536 entries per channel);
+// dst may alias src.
+static void apply_lut16(const Image16& src, Image16& dst, const uint16_t* const* luts) {
+    if (&dst != &src) {
+        dst.w = src.w; dst.h = src.h; dst.c = src.c;
+        dst.data.resize(src.data.size());
+    }
+    const int c = src.c;
+    const size_t rowN = static_cast<size_t>(src.w) * c;
+    parallel_rows(src.h, [&](int y0, int y1) {
+        const uint16_t* p = src.data.data() + rowN * y0;
+        const uint16_t* e = src.data.data() + rowN * y1;
+        uint16_t* q = dst.data.data() + rowN * y0;
+        if (c == 1) {
+            const uint16_t* lut = luts[0];
+            for (; p + 4 <= e; p += 4, q += 4) {
+                const uint16_t a = lut[p[0]], b = lut[p[1]], cc = lut[p[2]], d = lut[p[3]];
+                q[0] = a; q[1] = b; q[2] = cc; q[3] = d;
+            }
+            for (; p < e; ++p, ++q) *q = lut[*p];
+        } else {
+            for (; p < e; p += c, q += c)
+                for (int k = 0; k < c; ++k) q[k] = luts[k][p[k]];
+        }
+    });
+}
+
+// op_curve(in, master, chan): 8-bit tone curve, compiled to 256-entry LUTs per channel
+static Image op_curve(const Image& in, const ToneCurve& master, const ToneCurve* chan) {
+    if (in.empty() || in.c > 3) return Image{};
+    vector<float> f;
+    compile_curve_luts(master, chan, in.c, 256, f);
+    uint8_t tab[3][256];
+    const uint8_t* luts[3] = { tab[0], tab[1], tab[2] };
+    for (int k = 0; k < in.c; ++k)
+        for (int i = 0; i < 256; ++i) tab[k][i] = clamp_u8f(f[k * 256 + i]);
+    Image out;
+    apply_lut8_channels(in, out, luts);
+    return out;
+}
+
+// op_curve16(in, master, chan): 16-bit tone curve, compiled to 65536-entry LUTs per channel
+static Image16 op_curve16(const Image16& in, const ToneCurve& master, const ToneCurve* chan) {
+    if (in.empty() || in.c > 3) return Image16{};
+    vector<float> f;
+    compile_curve_luts(master, chan, in.c, 65536, f);
+    vector<uint16_t> tab(f.size());
+    for (size_t i = 0; i < f.size(); ++i) tab[i] = static_cast<uint16_t>(lround(f[i]));
+    const uint16_t* luts[3] = { &tab[0], &tab[0], &tab[0] };
+    for (int k = 0; k < in.c; ++k) luts[k] = &tab[static_cast<size_t>(k) * 65536];
+    Image16 out;
+    apply_lut16(in, out, luts);
+    return out;
+}
+
+// --------------------- Histogram ---------------------
+// Histogram: counts[k * bins + v] = number of samples of channel k with value v.
+// bins is 256 for 8-bit images and 65536 for 16-bit ones. In luma mode there is one
+// channel holding the BT.601 luminance (luma_u8) of each RGB pixel.
+struct Histogram {
+    int bins = 0, channels = 0;
+    vector<uint64_t> counts;
+    uint64_t total(int k) const {
+        uint64_t t = 0;
+        for (int v = 0; v < bins; ++v) t += counts[static_cast<size_t>(k) * bins + v];
+        return t;
+    }
+};
+
+// hist_rows<T, SUBS>(img, mask, luma, step, y0, y1, out):
+// Counts rows [y0,y1) into SUBS interleaved sub-histograms (the i-th counted pixel goes to
+// sub i % SUBS), so runs of equal values hit different counters instead of stalling on the
+// previous increment's store. Sub-histograms are 32-bit and flushed into `out` (64-bit) well
+// before they could wrap. mask (c>=1, same size) keeps pixels whose first channel is non-zero.
+// step > 1 subsamples: only rows and columns that are multiples of step are counted.
+template <typename T, int SUBS>
+static void hist_rows(const ImageT<T>& img, const Image* mask, bool luma, int step,
+                      int y0, int y1, int bins, vector<uint64_t>& out) {
+    const int c  = img.c;
+    const int oc = luma ? 1 : c;
+    const size_t plane = static_cast<size_t>(oc) * bins;    // one sub-histogram
+    vector<uint32_t> sub(plane * SUBS, 0);
+    uint64_t pending = 0;                                    // samples since last flush
+
+    auto flush = [&]() {
+        for (int s = 0; s < SUBS; ++s)
+            for (size_t i = 0; i < plane; ++i) out[i] += sub[s * plane + i];
+        fill(sub.begin(), sub.end(), 0u);
+        pending = 0;
+    };
+
+    const int w = img.w;
+    const int ystart = (y0 + step - 1) / step * step;
+    for (int y = ystart; y < y1; y += step) {
+        const T* p = &img.data[static_cast<size_t>(y) * w * c];
+        const uint8_t* m = mask ? &mask->data[static_cast<size_t>(y) * w * mask->c] : nullptr;
+        uint32_t* h = sub.data();
+
+        if (!m && !luma && c == 1 && step == 1) {
+            // Hot path: gray, no mask, every pixel
+            int x = 0;
+            for (; x + SUBS <= w; x += SUBS)
+                for (int s = 0; s < SUBS; ++s) ++h[s * plane + p[x + s]];
+            for (int s = 0; x < w; ++x, ++s) ++h[s * plane + p[x]];
+        } else if (!m && !luma) {
+            for (int x = 0, i = 0; x < w; x += step, ++i) {
+                uint32_t* hs = h + (i % SUBS) * plane;
+                const T* q = p + static_cast<size_t>(x) * c;
+                for (int k = 0; k < c; ++k) ++hs[k * bins + q[k]];
+            }
+        } else {
+            const int mc = mask ? mask->c : 0;
+            for (int x = 0, i = 0; x < w; x += step, ++i) {
+                uint32_t* hs = h + (i % SUBS) * plane;
+                const T* q = p + static_cast<size_t>(x) * c;
+                // Branch-free masking: add 0 or 1 (masks are rarely predictable)
+                const uint32_t inc = m ? (m[static_cast<size_t>(x) * mc] != 0) : 1u;
+                if (luma) hs[luma_u8(q[0], q[1], q[2])] += inc;
+                else for (int k = 0; k < c; ++k) hs[k * bins + q[k]] += inc;
+            }
+        }
+        pending += static_cast<uint64_t>(w);
+        if (pending > (1u << 30)) flush();
+    }
+    flush();
+}
+
+// compute_histogram(img, luma, mask, step):
+// Per-channel (luma=false) or luminance (luma=true, needs c=3) histogram of an 8- or
+// 16-bit image, optionally restricted to mask != 0 and subsampled on a step x step grid.
+// Bands of rows are counted in parallel, each with private sub-histograms, and merged
+// at the end. Returns an empty Histogram (bins == 0) on invalid input.
+template <typename T>
+static Histogram compute_histogram(const ImageT<T>& img, bool luma, const Image* mask = nullptr,
+                                   int step = 1) {
+    Histogram hist;
+    if (img.empty()) return hist;
+    if (luma && img.c != 3) { cerr << "Luminance histogram needs an RGB (c=3) image\n"; return hist; }
+    if (step < 1) step = 1;
+    if (mask && (mask->w != img.w || mask->h != img.h)) {
+        cerr << "Mask size " << mask->w << "x" << mask->h << " != image " << img.w << "x" << img.h << "\n";
+        return hist;
+    }
+    const int bins = (sizeof(T) == 1) ? 256 : 65536;
+    hist.bins = bins;
+    hist.channels = luma ? 1 : img.c;
+    hist.counts.assign(static_cast<size_t>(hist.channels) * bins, 0);
+
+    mutex merge;
+    parallel_rows(img.h, [&](int y0, int y1) {
+        vector<uint64_t> local(hist.counts.size(), 0);
+        // 16-bit tables are large; 2 subs keep them within L2 while still breaking the chains
+        if (sizeof(T) == 1) hist_rows<T, 4>(img, mask, luma, step, y0, y1, bins, local);
+        else                hist_rows<T, 2>(img, mask, luma, step, y0, y1, bins, local);
+        lock_guard<mutex> lock(merge);
+        for (size_t i = 0; i < local.size(); ++i) hist.counts[i] += local[i];
+    });
+    return hist;
+}
+
+// Summary of one histogram channel (empty channel => count 0, min/max -1)
+struct HistStats { uint64_t count = 0; int min = -1, max = -1; double mean = 0.0, stddev = 0.0; };
+
+static HistStats hist_stats(const Histogram& hist, int k) {
+    HistStats st;
+    const uint64_t* h = &hist.counts[static_cast<size_t>(k) * hist.bins];
+    double sum = 0.0, sum2 = 0.0;
+    for (int v = 0; v < hist.bins; ++v) {
+        if (!h[v]) continue;
+        if (st.min < 0) st.min = v;
+        st.max = v;
+        st.count += h[v];
+        sum  += static_cast<double>(h[v]) * v;
+        sum2 += static_cast<double>(h[v]) * v * v;
+    }
+    if (st.count) {
+        st.mean = sum / st.count;
+        st.stddev = sqrt(max(0.0, sum2 / st.count - st.mean * st.mean));
+    }
+    return st;
+}
+
+// hist_channel_names(hist, luma): "gray" / "r,g,b" / "y" (luma) column names
+static vector<string> hist_channel_names(const Histogram& hist, bool luma) {
+    if (luma) return { "y" };
+    if (hist.channels == 1) return { "gray" };
+    if (hist.channels == 3) return { "r", "g", "b" };
+    vector<string> names;
+    for (int k = 0; k < hist.channels; ++k) names.push_back("c" + to_string(k));
+    return names;
+}
+
+// write_hist_csv(out, hist, names): header "bin,<names...>", then one row per bin
+static void write_hist_csv(ostream& out, const Histogram& hist, const vector<string>& names) {
+    out << "bin";
+    for (const string& n : names) out << "," << n;
+    out << "\n";
+    for (int v = 0; v < hist.bins; ++v) {
+        out << v;
+        for (int k = 0; k < hist.channels; ++k) out << "," << hist.counts[static_cast<size_t>(k) * hist.bins + v];
+        out << "\n";
+    }
+}
+
+// write_hist_json(out, hist, names, w, h): image info, per-channel summary and counts
+static void write_hist_json(ostream& out, const Histogram& hist, const vector<string>& names, int w, int h) {
+    out << "{\n  \"width\": " << w << ", \"height\": " << h << ", \"bins\": " << hist.bins << ",\n";
+    out << "  \"channels\": [\n";
+    for (int k = 0; k < hist.channels; ++k) {
+        const HistStats st = hist_stats(hist, k);
+        out << "    {\"name\": \"" << names[k] << "\", \"count\": " << st.count
+            << ", \"min\": " << st.min << ", \"max\": " << st.max
+            << ", \"mean\": " << fixed << setprecision(4) << st.mean
+            << ", \"stddev\": " << st.stddev << defaultfloat << ",\n      \"hist\": [";
+        const uint64_t* hk = &hist.counts[static_cast<size_t>(k) * hist.bins];
+        for (int v = 0; v < hist.bins; ++v) out << (v ? "," : "") << hk[v];
+        out << "]}" << (k + 1 < hist.channels ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+// --------------------- Histogram-based enhancement ---------------------
+// equalize_lut(h, lut):
+// Classic CDF mapping over a 256-bin histogram:
+//   lut[v] = round((cdf(v) - cdf_min) * 255 / (N - cdf_min))
+// cdf_min is the count of the darkest occupied bin, so the darkest level maps to 0.
+// A single-level (or empty) histogram gives the identity mapping.
+static void equalize_lut(const uint64_t* h, uint8_t lut[256]) {
+    uint64_t n = 0, cdf_min = 0;
+    for (int v = 0; v < 256; ++v) {
+        if (!cdf_min && h[v]) cdf_min = h[v];
+        n += h[v];
+    }
+    if (n == cdf_min) {
+        for (int v = 0; v < 256; ++v) lut[v] = static_cast<uint8_t>(v);
+        return;
+    }
+    const double scale = 255.0 / static_cast<double>(n - cdf_min);
+    uint64_t cdf = 0;
+    for (int v = 0; v < 256; ++v) {
+        cdf += h[v];
+        const double s = cdf > cdf_min ? (cdf - cdf_min) * scale : 0.0;
+        lut[v] = static_cast<uint8_t>(lround(s));
+    }
+}
+
+// op_equalize(in):
+// Global histogram equalization in two memory passes: histogram, then LUT apply.
+// Gray (c=1): histogram and LUT on the values themselves.
+// RGB  (c=3): histogram of the luminance; the resulting LUT is applied to R, G and B,
+//             which stretches contrast like the gray case without a color-space round trip.
+static Image op_equalize(const Image& in) {
+    const bool luma = (in.c == 3);
+    const Histogram hist = compute_histogram(in, luma);
+    if (hist.bins == 0) return Image{};
+    uint8_t lut[256];
+    equalize_lut(hist.counts.data(), lut);
+    Image out;
+    apply_lut8(in, out, lut);
+    return out;
+}
+
+// clahe_tile_lut(h, area, clip, lut):
+// Clips the tile histogram at clip * area / 256 (clip <= 0: no clipping), spreads the
+// excess evenly over all bins (remainder in equal steps), then maps v -> 255 * cdf(v) / area.
+static void clahe_tile_lut(uint32_t h[256], int area, float clip, uint8_t lut[256]) {
+    if (clip > 0.f) {
+        const int limit = max(1, static_cast<int>(clip * area / 256));
+        int excess = 0;
+        for (int v = 0; v < 256; ++v) {
+            if (h[v] > static_cast<uint32_t>(limit)) { excess += h[v] - limit; h[v] = limit; }
+        }
+        const int each = excess / 256;
+        const int rest = excess - each * 256;
+        for (int v = 0; v < 256; ++v) h[v] += each;
+        if (rest > 0) {
+            const int step = max(256 / rest, 1);
+            for (int v = 0, left = rest; v < 256 && left > 0; v += step, --left) ++h[v];
+        }
+    }
+    const float scale = 255.0f / area;
+    uint32_t cdf = 0;
+    for (int v = 0; v < 256; ++v) {
+        cdf += h[v];
+        lut[v] = clamp_u8f(cdf * scale);
+    }
+}
+
+// op_clahe(in, gx, gy, clip):
+// Contrast-limited adaptive histogram equalization on a gx x gy tile grid.
+//  1) Per-tile histograms (luminance for RGB), clipped and turned into LUTs; tiles run in parallel.
+//  2) Each pixel blends the LUTs of the 4 nearest tile centers bilinearly (edges clamp to the
+//     outer tiles). Per row, the 4 LUT lookups are gathered into small buffers and blended in
+//     fixed point with SSE2 (8 samples per step).
+// RGB uses the luminance-derived LUTs on every channel, like op_equalize().
+static Image op_clahe(const Image& in, int gx, int gy, float clip) {
+    if (in.empty()) return Image{};
+    if (in.c != 1 && in.c != 3) { cerr << "CLAHE needs c=1 or c=3\n"; return Image{}; }
+    if (gx < 1 || gy < 1 || gx > in.w || gy > in.h) {
+        cerr << "CLAHE tile grid " << gx << "x" << gy << " does not fit " << in.w << "x" << in.h << "\n";
+        return Image{};
+    }
+    const int W = in.w, H = in.h, c = in.c;
+    const double tw = static_cast<double>(W) / gx, th = static_cast<double>(H) / gy;
+
+    // 1) tile LUTs: luts[(ty * gx + tx) * 256 + v]
+    vector<uint8_t> luts(static_cast<size_t>(gx) * gy * 256);
+    parallel_rows(gx * gy, [&](int t0, int t1) {
+        for (int t = t0; t < t1; ++t) {
+            const int tx = t % gx, ty = t / gx;
+            const int x0 = static_cast<int>(tx * tw), x1 = static_cast<int>((tx + 1) * tw);
+            const int y0 = static_cast<int>(ty * th), y1 = static_cast<int>((ty + 1) * th);
+            uint32_t h[4][256] = {};                         // 4 subs, as in hist_rows()
+            for (int y = y0; y < y1; ++y) {
+                const uint8_t* p = &in.data[(static_cast<size_t>(y) * W + x0) * c];
+                const int n = x1 - x0;
+                if (c == 1) {
+                    int x = 0;
+                    for (; x + 4 <= n; x += 4) { ++h[0][p[x]]; ++h[1][p[x+1]]; ++h[2][p[x+2]]; ++h[3][p[x+3]]; }
+                    for (; x < n; ++x) ++h[0][p[x]];
+                } else {
+                    for (int x = 0; x < n; ++x, p += 3) ++h[x & 3][luma_u8(p[0], p[1], p[2])];
+                }
+            }
+            for (int v = 0; v < 256; ++v) h[0][v] += h[1][v] + h[2][v] + h[3][v];
+            clahe_tile_lut(h[0], (x1 - x0) * (y1 - y0), clip, &luts[static_cast<size_t>(t) * 256]);
+        }
+    });
+
+    // 2) per-sample column tables: LUT offsets of the left/right tile and the 1.7 right weight
+    const size_t rowN = static_cast<size_t>(W) * c;
+    vector<int> colL(rowN), colR(rowN);
+    vector<uint16_t> wxR(rowN);
+    for (int x = 0; x < W; ++x) {
+        const double fx = (x + 0.5) / tw - 0.5;
+        int tx1 = static_cast<int>(floor(fx));
+        const int wx = static_cast<int>(lround((fx - tx1) * 128));
+        int tx2 = tx1 + 1;
+        tx1 = clamp_val(tx1, 0, gx - 1);
+        tx2 = clamp_val(tx2, 0, gx - 1);
+        for (int k = 0; k < c; ++k) {
+            colL[static_cast<size_t>(x) * c + k] = tx1 * 256;
+            colR[static_cast<size_t>(x) * c + k] = tx2 * 256;
+            wxR [static_cast<size_t>(x) * c + k] = static_cast<uint16_t>(wx);
+        }
+    }
+
+    Image out; out.w = W; out.h = H; out.c = c;
+    out.data.resize(in.data.size());
+    parallel_rows(H, [&](int y0, int y1) {
+        vector<uint8_t> a(rowN), b(rowN), cc(rowN), d(rowN);   // TL, TR, BL, BR lookups
+        for (int y = y0; y < y1; ++y) {
+            const double fy = (y + 0.5) / th - 0.5;
+            int ty1 = static_cast<int>(floor(fy));
+            const int wy = static_cast<int>(lround((fy - ty1) * 256));
+            int ty2 = ty1 + 1;
+            ty1 = clamp_val(ty1, 0, gy - 1);
+            ty2 = clamp_val(ty2, 0, gy - 1);
+            const uint8_t* top = &luts[static_cast<size_t>(ty1) * gx * 256];
+            const uint8_t* bot = &luts[static_cast<size_t>(ty2) * gx * 256];
+            const uint8_t* sp = &in.data[static_cast<size_t>(y) * rowN];
+            uint8_t* dp = &out.data[static_cast<size_t>(y) * rowN];
+
+            for (size_t i = 0; i < rowN; ++i) {
+                const uint8_t v = sp[i];
+                a[i]  = top[colL[i] + v];
+                b[i]  = top[colR[i] + v];
+                cc[i] = bot[colL[i] + v];
+                d[i]  = bot[colR[i] + v];
+            }
+
+            // out = ((a*(128-wx) + b*wx) * (256-wy) + (c*(128-wx) + d*wx) * wy + 2^14) >> 15
+            // (x weights in 1.7, y weights in 8.8: the horizontal blends stay within int16)
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i k128 = _mm_set1_epi16(128);
+            const __m128i wyy  = _mm_set1_epi32((wy << 16) | (256 - wy));   // (256-wy, wy) pairs
+            const __m128i half = _mm_set1_epi32(1 << 14);
+            for (; i + 8 <= rowN; i += 8) {
+                const __m128i wx1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&wxR[i]));
+                const __m128i wx0 = _mm_sub_epi16(k128, wx1);
+                const __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&a[i])),  zero);
+                const __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&b[i])),  zero);
+                const __m128i vc = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&cc[i])), zero);
+                const __m128i vd = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&d[i])),  zero);
+                const __m128i t = _mm_add_epi16(_mm_mullo_epi16(va, wx0), _mm_mullo_epi16(vb, wx1));
+                const __m128i u = _mm_add_epi16(_mm_mullo_epi16(vc, wx0), _mm_mullo_epi16(vd, wx1));
+                __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(t, u), wyy);
+                __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(t, u), wyy);
+                lo = _mm_srli_epi32(_mm_add_epi32(lo, half), 15);
+                hi = _mm_srli_epi32(_mm_add_epi32(hi, half), 15);
+                const __m128i r16 = _mm_packs_epi32(lo, hi);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(&dp[i]), _mm_packus_epi16(r16, r16));
+            }
+#endif
+            for (; i < rowN; ++i) {
+                const uint32_t wx1 = wxR[i], wx0 = 128 - wx1;
+                const uint32_t t = a[i] * wx0 + b[i] * wx1;
+                const uint32_t u = cc[i] * wx0 + d[i] * wx1;
+                dp[i] = static_cast<uint8_t>((t * (256u - wy) + u * static_cast<uint32_t>(wy) + (1u << 14)) >> 15);
+            }
+        }
+    });
+    return out;
+}
+
+// percentile_bin(h, bins, pct): smallest v with cdf(v) >= pct% of the total (0 if empty)
+static int percentile_bin(const uint64_t* h, int bins, double pct) {
+    uint64_t total = 0;
+    for (int v = 0; v < bins; ++v) total += h[v];
+    if (!total) return 0;
+    const double target = clamp_val(pct, 0.0, 100.0) / 100.0 * static_cast<double>(total);
+    uint64_t cdf = 0;
+    for (int v = 0; v < bins; ++v) {
+        cdf += h[v];
+        if (cdf > 0 && static_cast<double>(cdf) >= target) return v;
+    }
+    return bins - 1;
+}
+
+// stretch_lut(lo, hi, lut): linear map lo -> 0, hi -> 255, clamped; identity if hi <= lo
+static void stretch_lut(int lo, int hi, uint8_t lut[256]) {
+    for (int v = 0; v < 256; ++v) {
+        lut[v] = (hi <= lo) ? static_cast<uint8_t>(v)
+                            : clamp_u8f(static_cast<float>(v - lo) * 255.0f / static_cast<float>(hi - lo));
+    }
+}
+
+// op_autolevels(in, low_pct, high_pct, per_channel, step):
+// Percentile-based contrast stretch. The histogram is taken on a step x step subsample
+// (step 1 = every pixel), which is plenty for percentiles on large images.
+//   linked (default): one lo/hi from all channels pooled, applied to every channel (keeps hue)
+//   per_channel:      lo/hi per channel (also neutralizes a color cast)
+static Image op_autolevels(const Image& in, double low_pct, double high_pct, bool per_channel, int step) {
+    const Histogram hist = compute_histogram(in, false, nullptr, step);
+    if (hist.bins == 0) return Image{};
+    const int c = in.c;
+    uint8_t tab[3][256];
+    const uint8_t* luts[3] = { tab[0], tab[1], tab[2] };
+    if (per_channel) {
+        for (int k = 0; k < c; ++k) {
+            const uint64_t* h = &hist.counts[static_cast<size_t>(k) * 256];
+            stretch_lut(percentile_bin(h, 256, low_pct), percentile_bin(h, 256, high_pct), tab[k]);
+        }
+    } else {
+        uint64_t pooled[256] = {};
+        for (int k = 0; k < c; ++k)
+            for (int v = 0; v < 256; ++v) pooled[v] += hist.counts[static_cast<size_t>(k) * 256 + v];
+        stretch_lut(percentile_bin(pooled, 256, low_pct), percentile_bin(pooled, 256, high_pct), tab[0]);
+        for (int k = 1; k < c; ++k) memcpy(tab[k], tab[0], 256);
+    }
+    Image out;
+    if (per_channel) apply_lut8_channels(in, out, luts);
+    else             apply_lut8(in, out, tab[0]);
+    return out;
+}
+
+// --------------------- Thresholding ---------------------
+// multi_otsu(h, classes, thr):
+// Otsu's criterion for classes = 2..4: choose classes-1 thresholds t0 < t1 < ... maximizing
+// the between-class variance, i.e. sum_k S_k^2 / P_k (P = pixel count, S = value sum of class k).
+// Exhaustive search over 256^(classes-1) candidates with prefix sums, so each candidate is O(1).
+// Class k holds values v with thr[k-1] < v <= thr[k]. Returns false if the histogram is empty.
+static bool multi_otsu(const uint64_t* h, int classes, int thr[3]) {
+    double P[257] = {0.0}, S[257] = {0.0};   // prefix sums over bins [0, i)
+    for (int v = 0; v < 256; ++v) {
+        P[v + 1] = P[v] + static_cast<double>(h[v]);
+        S[v + 1] = S[v] + static_cast<double>(h[v]) * v;
+    }
+    if (P[256] <= 0.0) return false;
+    // class term for bins (a, b]: values a+1..b
+    auto term = [&](int a, int b) -> double {
+        const double p = P[b + 1] - P[a + 1];
+        if (p <= 0.0) return 0.0;
+        const double s = S[b + 1] - S[a + 1];
+        return s * s / p;
+    };
+    double best = -1.0;
+    if (classes == 2) {
+        for (int t0 = 0; t0 < 255; ++t0) {
+            const double v = term(-1, t0) + term(t0, 255);
+            if (v > best) { best = v; thr[0] = t0; }
+        }
+    } else if (classes == 3) {
+        for (int t0 = 0; t0 < 254; ++t0) {
+            const double a = term(-1, t0);
+            for (int t1 = t0 + 1; t1 < 255; ++t1) {
+                const double v = a + term(t0, t1) + term(t1, 255);
+                if (v > best) { best = v; thr[0] = t0; thr[1] = t1; }
+            }
+        }
+    } else {
+        for (int t0 = 0; t0 < 253; ++t0) {
+            const double a = term(-1, t0);
+            for (int t1 = t0 + 1; t1 < 254; ++t1) {
+                const double b = a + term(t0, t1);
+                for (int t2 = t1 + 1; t2 < 255; ++t2) {
+                    const double v = b + term(t1, t2) + term(t2, 255);
+                    if (v > best) { best = v; thr[0] = t0; thr[1] = t1; thr[2] = t2; }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// threshold_row(src, dst, n, thr, nt, step):
+// dst = sum_i (src > thr[i] ? step[i] : 0), i.e. the output level of the class each sample
+// falls in (levels are cumulative steps, so they stay <= 255). SSE2 does the unsigned compare
+// by flipping the sign bit and turns each compare mask into its step with an AND.
+static void threshold_row(const uint8_t* src, uint8_t* dst, int n, const int* thr, int nt, const uint8_t* step) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+    __m128i vt[3], vs[3];
+    for (int k = 0; k < nt; ++k) {
+        vt[k] = _mm_set1_epi8(static_cast<char>(thr[k] ^ 0x80));
+        vs[k] = _mm_set1_epi8(static_cast<char>(step[k]));
+    }
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), bias);
+        __m128i acc = _mm_setzero_si128();
+        for (int k = 0; k < nt; ++k)
+            acc = _mm_add_epi8(acc, _mm_and_si128(_mm_cmpgt_epi8(v, vt[k]), vs[k]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), acc);
+    }
+#endif
+    for (; i < n; ++i) {
+        int acc = 0;
+        for (int k = 0; k < nt; ++k) acc += (src[i] > thr[k]) ? step[k] : 0;
+        dst[i] = static_cast<uint8_t>(acc);
+    }
+}
+
+// op_threshold(in, thr, nt, raw_labels):
+// Single pass to a c=1 image: RGB rows are first reduced to luminance in a row buffer.
+// raw_labels=false -> classes spread over 0..255 (2 classes = binary mask 0/255)
+// raw_labels=true  -> class index 0..nt
+static Image op_threshold(const Image& in, const int* thr, int nt, bool raw_labels) {
+    if (in.empty()) return Image{};
+    if (in.c != 1 && in.c != 3) { cerr << "Threshold needs c=1 or c=3\n"; return Image{}; }
+    uint8_t step[3];
+    for (int k = 0; k < nt; ++k) {
+        const int lo = raw_labels ? k     : 255 * k / nt;
+        const int hi = raw_labels ? k + 1 : 255 * (k + 1) / nt;
+        step[k] = static_cast<uint8_t>(hi - lo);
+    }
+    Image out; out.w = in.w; out.h = in.h; out.c = 1;
+    out.data.resize(static_cast<size_t>(in.w) * in.h);
+    parallel_rows(in.h, [&](int y0, int y1) {
+        vector<uint8_t> luma(in.c == 3 ? in.w : 0);
+        for (int y = y0; y < y1; ++y) {
+            const uint8_t* sp = &in.data[static_cast<size_t>(y) * in.w * in.c];
+            if (in.c == 3) {
+                for (int x = 0; x < in.w; ++x, sp += 3) luma[x] = static_cast<uint8_t>(luma_u8(sp[0], sp[1], sp[2]));
+                sp = luma.data();
+            }
+            threshold_row(sp, &out.data[static_cast<size_t>(y) * in.w], in.w, thr, nt, step);
+        }
+    });
+    return out;
+}
+
+// --------------------- Image arithmetic (combine) ---------------------
+// Per-sample binary ops on two images of identical size and channel count:
+//   add     sat(a + b)            sub    sat(a - b)  (clamps at 0)      absdiff |a - b|
+//   mul     sat(a * b / max * scale)                                    (max = 255 or 65535)
+//   blend   a * (1 - alpha) + b * alpha
+// add/sub/absdiff map directly onto the saturating SSE2 instructions (paddus/psubus);
+// blend is 8.8 fixed point on 8-bit data, mul and 16-bit blend use SSE float lanes.
+enum class CombineOp { Add, Sub, AbsDiff, Mul, Blend };
+
+struct CombineParams {
+    CombineOp op = CombineOp::Add;
+    float scale = 1.0f;   // mul, >= 0 (negative or NaN acts as 0)
+    float alpha = 0.5f;   // blend
+};
+
+#if defined(__SSE2__)
+// pack_u16_ps(lo, hi): 8 floats (already in 0..65535) -> 8 x uint16 with rounding, SSE2 only
+static inline __m128i pack_u16_ps(__m128 lo, __m128 hi) {
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i a = _mm_sub_epi32(_mm_cvtps_epi32(lo), bias);
+    const __m128i b = _mm_sub_epi32(_mm_cvtps_epi32(hi), bias);
+    return _mm_xor_si128(_mm_packs_epi32(a, b), _mm_set1_epi16(static_cast<short>(0x8000)));
+}
+#endif
+
+static void combine_row(const uint8_t* a, const uint8_t* b, uint8_t* d, size_t n, const CombineParams& p) {
+    size_t i = 0;
+    const int wb = static_cast<int>(lround(clamp_val(p.alpha, 0.0f, 1.0f) * 256.0f));
+    const float k = (p.scale > 0.0f ? p.scale : 0.0f) / 255.0f;   // NaN / negative -> 0, same in SIMD and scalar
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vwb = _mm_set1_epi16(static_cast<short>(wb)), vwa = _mm_set1_epi16(static_cast<short>(256 - wb));
+    const __m128i r128 = _mm_set1_epi16(128);
+    const __m128 vk = _mm_set1_ps(k), top = _mm_set1_ps(255.0f);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i r;
+        switch (p.op) {
+        case CombineOp::Add:     r = _mm_adds_epu8(va, vb); break;
+        case CombineOp::Sub:     r = _mm_subs_epu8(va, vb); break;
+        case CombineOp::AbsDiff: r = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)); break;
+        case CombineOp::Blend: {
+            // (a*(256-w) + b*w + 128) >> 8; both products fit 16 bits unsigned
+            const __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), vwa),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), vwb)), r128), 8);
+            const __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), vwa),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), vwb)), r128), 8);
+            r = _mm_packus_epi16(lo, hi);
+            break;
+        }
+        default: {   // Mul: a*b (exact in 16 bits) -> float lanes
+            const __m128i plo = _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            const __m128i phi = _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            __m128i q[4];
+            const __m128i parts[4] = { _mm_unpacklo_epi16(plo, zero), _mm_unpackhi_epi16(plo, zero),
+                                       _mm_unpacklo_epi16(phi, zero), _mm_unpackhi_epi16(phi, zero) };
+            for (int j = 0; j < 4; ++j)
+                q[j] = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(parts[j]), vk), top));
+            r = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+            break;
+        }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), r);
+    }
+#endif
+    for (; i < n; ++i) {
+        const int x = a[i], y = b[i];
+        int r;
+        switch (p.op) {
+        case CombineOp::Add:     r = min(x + y, 255); break;
+        case CombineOp::Sub:     r = max(x - y, 0); break;
+        case CombineOp::AbsDiff: r = abs(x - y); break;
+        case CombineOp::Blend:   r = (x * (256 - wb) + y * wb + 128) >> 8; break;
+        default:                 r = static_cast<int>(nearbyintf(clamp_val(x * y * k, 0.0f, 255.0f))); break;   // saturates like packus
+        }
+        d[i] = static_cast<uint8_t>(r);
+    }
+}
+
+static void combine_row(const uint16_t* a, const uint16_t* b, uint16_t* d, size_t n, const CombineParams& p) {
+    size_t i = 0;
+    const float alpha = clamp_val(p.alpha, 0.0f, 1.0f);
+    const float k = (p.scale > 0.0f ? p.scale : 0.0f) / 65535.0f;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 va0 = _mm_set1_ps(1.0f - alpha), vb0 = _mm_set1_ps(alpha), vk = _mm_set1_ps(k);
+    const __m128 top = _mm_set1_ps(65535.0f);
+    for (; i + 8 <= n; i += 8) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i r;
+        switch (p.op) {
+        case CombineOp::Add:     r = _mm_adds_epu16(va, vb); break;
+        case CombineOp::Sub:     r = _mm_subs_epu16(va, vb); break;
+        case CombineOp::AbsDiff: r = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va)); break;
+        default: {
+            const __m128 alo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(va, zero));
+            const __m128 ahi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(va, zero));
+            const __m128 blo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vb, zero));
+            const __m128 bhi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vb, zero));
+            __m128 lo, hi;
+            if (p.op == CombineOp::Blend) {
+                lo = _mm_add_ps(_mm_mul_ps(alo, va0), _mm_mul_ps(blo, vb0));
+                hi = _mm_add_ps(_mm_mul_ps(ahi, va0), _mm_mul_ps(bhi, vb0));
+            } else {
+                lo = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(alo, blo), vk), top);
+                hi = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(ahi, bhi), vk), top);
+            }
+            r = pack_u16_ps(lo, hi);
+            break;
+        }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), r);
+    }
+#endif
+    for (; i < n; ++i) {
+        const int x = a[i], y = b[i];
+        float r;
+        switch (p.op) {
+        case CombineOp::Add:     r = static_cast<float>(min(x + y, 65535)); break;
+        case CombineOp::Sub:     r = static_cast<float>(max(x - y, 0)); break;
+        case CombineOp::AbsDiff: r = static_cast<float>(abs(x - y)); break;
+        case CombineOp::Blend:   r = x * (1.0f - alpha) + y * alpha; break;
+        default:                 r = static_cast<float>(x) * static_cast<float>(y) * k; break;
+        }
+        d[i] = static_cast<uint16_t>(nearbyintf(clamp_val(r, 0.0f, 65535.0f)));   // saturates like pack_u16_ps
+    }
+}
+
+// op_combine(a, b, p): checks that both images match in size and channels, then runs
+// combine_row() over parallel row bands. Returns an empty image on mismatch.
+template <typename T>
+static ImageT<T> op_combine(const ImageT<T>& a, const ImageT<T>& b, const CombineParams& p) {
+    if (a.empty() || b.empty()) return ImageT<T>{};
+    if (a.w != b.w || a.h != b.h || a.c != b.c) {
+        cerr << "combine: images differ (" << a.w << "x" << a.h << " c=" << a.c << " vs "
+             << b.w << "x" << b.h << " c=" << b.c << ")\n";
+        return ImageT<T>{};
+    }
+    ImageT<T> out; out.w = a.w; out.h = a.h; out.c = a.c;
+    out.data.resize(a.data.size());
+    const size_t rowN = static_cast<size_t>(a.w) * a.c;
+    parallel_rows(a.h, [&](int y0, int y1) {
+        combine_row(&a.data[rowN * y0], &b.data[rowN * y0], &out.data[rowN * y0], rowN * (y1 - y0), p);
+    });
+    return out;
+}
+
+// --------------------- Resizing ---------------------
+// All resizers split the output into row bands run on the thread pool (parallel_bands).
+// resize_band_rows(srcH, dstH, srcRowBytes, support): output rows per band.
+//   * a band should read about kBandBytes of source rows, so one worker's rows stay in its L2
+//   * a band re-reads the `support` source rows of its first output row; keep that under an
+//     eighth of what the band reads
+//   * keep at least kMinBands bands so many-core machines balance
+// Depends only on the geometry, so the bands (and the bytes written) are the same for any --threads.
+static constexpr size_t kBandBytes = 256 * 1024;
+static constexpr int kMinBands = 64;
+
+static int resize_band_rows(int srcH, int dstH, size_t srcRowBytes, int support) {
+    const double r = static_cast<double>(srcH) / dstH;   // source rows per output row
+    const double byCache = kBandBytes / (r * max<size_t>(srcRowBytes, 1));
+    const int minRows = static_cast<int>(ceil(8.0 * support / r));
+    int rows = static_cast<int>(min<double>(byCache, (dstH + kMinBands - 1) / kMinBands));
+    return clamp_val(max(rows, minRows), 1, max(dstH, 1));
+}
+
+//--------------------- NN resize ---------------------
+// resize_nearest(in, newW, newH):
+// Pixel-centered mapping: fx=(x+0.5)*sx - 0.5, fy=(y+0.5)*sy - 0.5.
+// Round to nearest source index; clamp at borders.
+// Very fast; produces blockiness when upscaling.
+// The mapping is evaluated once into a column offset table and a row index table:
+//   * output rows that map to the same source row as the previous one are a memcpy of it
+//   * c=1 rows gather 8 columns per AVX2 step; c=3 pixels move as overlapping 4-byte copies
+//   * upscales (newW >= 2*w) walk runs of equal source columns and replicate bytes (memset for c=1)
+// nearest_index(): floor((i+0.5)*srcN/dstN - 0.5) evaluated exactly as
+// floor(((2i+1)*srcN - dstN) / (2*dstN)), so the table cannot change with FMA contraction.
+static vector<int> nearest_index(int srcN, int dstN) {
+    vector<int> idx(dstN);
+    const long long den = 2LL * dstN;
+    for (int i = 0; i < dstN; ++i) {
+        const long long num = (2LL * i + 1) * srcN - dstN;
+        const long long q = num >= 0 ? num / den : -((-num + den - 1) / den);
+        idx[i] = clamp_val(static_cast<int>(q), 0, srcN - 1);
+    }
+    return idx;
+}
+
+struct NearestRun { int off, len; };   // source sample offset, number of output pixels
+
+template <typename T>
+static void nearest_row(const T* src, const vector<int>& xofs, const vector<NearestRun>& runs, int c, T* dst) {
+    const int W = static_cast<int>(xofs.size());
+    if (!runs.empty()) {
+        for (const NearestRun& r : runs) {
+            for (int k = 0; k < r.len; ++k, dst += c) memcpy(dst, src + r.off, sizeof(T) * c);
+        }
+        return;
+    }
+    for (int x = 0; x < W; ++x) memcpy(dst + static_cast<size_t>(x) * c, src + xofs[x], sizeof(T) * c);
+}
+
+static void nearest_row(const uint8_t* src, const vector<int>& xofs, const vector<NearestRun>& runs, int c,
+                        uint8_t* dst) {
+    const int W = static_cast<int>(xofs.size());
+    if (!runs.empty()) {
+        if (c == 1) {
+            for (const NearestRun& r : runs) { memset(dst, src[r.off], r.len); dst += r.len; }
+        } else {
+            for (const NearestRun& r : runs) {
+                memcpy(dst, src + r.off, c);   // first copy, then double the filled span
+                for (int have = 1; have < r.len; have *= 2)
+                    memcpy(dst + static_cast<size_t>(have) * c, dst, static_cast<size_t>(min(have, r.len - have)) * c);
+                dst += static_cast<size_t>(r.len) * c;
+            }
+        }
+        return;
+    }
+    int x = 0;
+    if (c == 1) {
+#if defined(__AVX2__)
+        // 32-bit gathers at byte offsets: stop while offset+4 stays inside the source row
+        const int lastSafe = xofs.empty() ? 0 : xofs[W - 1];   // xofs is non-decreasing
+        const __m256i low = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                             0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m256i perm = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+        for (; x + 8 <= W && xofs[x + 7] + 4 <= lastSafe + 1; x += 8) {
+            const __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&xofs[x]));
+            const __m256i g = _mm256_i32gather_epi32(reinterpret_cast<const int*>(src), idx, 1);
+            const __m256i b = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(g, low), perm);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm256_castsi256_si128(b));
+        }
+#endif
+        for (; x < W; ++x) dst[x] = src[xofs[x]];
+    } else if (c == 3) {
+        // 4-byte copies overlap the next pixel's slot; the last pixel (and any that would read
+        // past the final source pixel) copy exactly 3 bytes
+        const int srcEnd = xofs.empty() ? 0 : xofs[W - 1];
+        for (; x + 1 < W && xofs[x] + 4 <= srcEnd + 3; ++x) memcpy(dst + 3 * x, src + xofs[x], 4);
+        for (; x < W; ++x) memcpy(dst + 3 * x, src + xofs[x], 3);
+    } else {
+        for (; x < W; ++x) memcpy(dst + static_cast<size_t>(x) * c, src + xofs[x], c);
+    }
+}
+
+// NearestX: column table of one resize — source sample offsets, plus runs of equal offsets on upscales
+struct NearestX {
+    vector<int> xofs;
+    vector<NearestRun> runs;
+};
+
+static NearestX nearest_x(int srcW, int dstW, int c) {
+    NearestX nx;
+    nx.xofs = nearest_index(srcW, dstW);
+    for (int& v : nx.xofs) v *= c;
+    if (dstW >= 2 * srcW) {
+        for (int x = 0; x < dstW; ++x) {
+            if (!nx.runs.empty() && nx.runs.back().off == nx.xofs[x]) ++nx.runs.back().len;
+            else nx.runs.push_back({ nx.xofs[x], 1 });
+        }
+    }
+    return nx;
+}
+
+template <typename T>
+static ImageT<T> resize_nearest(const ImageT<T>& in, int newW, int newH) {
+    ImageT<T> out; out.w = newW; out.h = newH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
+    const NearestX nx = nearest_x(in.w, newW, in.c);
+    const vector<int> yidx = nearest_index(in.h, newH);
+    const size_t srcRow = static_cast<size_t>(in.w) * in.c;
+    const size_t rowN = static_cast<size_t>(newW) * out.c;
+
+    parallel_bands(newH, resize_band_rows(in.h, newH, srcRow * sizeof(T), 1), [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            T* dp = &out.data[rowN * y];
+            if (y > y0 && yidx[y] == yidx[y - 1]) memcpy(dp, dp - rowN, rowN * sizeof(T));
+            else nearest_row(&in.data[srcRow * yidx[y]], nx.xofs, nx.runs, in.c, dp);
+        }
+    });
+    return out;
+}
+
+//--------------------- Bilinear resize (reference) ---------------------
+// resize_bilinear_ref(in, newW, newH): the original double-precision version, kept as the
+// reference for resize_bilinear() below (selected with --reference).
+// Let x0=floor(fx), x1=x0+1, wx=fx-x0 (same for y).
+// v0=(1-wx)*F(x0,y0) + wx*F(x1,y0)
+// v1=(1-wx)*F(x0,y1) + wx*F(x1,y1)
+// v =(1-wy)*v0       + wy*v1
+// Weights sum to 1; clamp indices; per-channel blend then store_sample() (clamp + round).
+template <typename T>
+static ImageT<T> resize_bilinear_ref(const ImageT<T>& in, int newW, int newH) {
+    ImageT<T> out; out.w = newW; out.h = newH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
+    const double scaleX = static_cast<double>(in.w) / newW;
+    const double scaleY = static_cast<double>(in.h) / newH;
+
+    parallel_bands(newH, resize_band_rows(in.h, newH, static_cast<size_t>(in.w) * in.c * sizeof(T), 2), [&](int ya, int yb) {
+        for (int y = ya; y < yb; ++y) {
+            double fy = (y + 0.5) * scaleY - 0.5;
+            int y0 = static_cast<int>(floor(fy));
+            int y1 = y0 + 1;
+            double wy = fy - y0;
+            y0 = clamp_val(y0, 0, in.h - 1);
+            y1 = clamp_val(y1, 0, in.h - 1);
+
+            for (int x = 0; x < newW; ++x) {
+                double fx = (x + 0.5) * scaleX - 0.5;
+                int x0 = static_cast<int>(floor(fx));
+                int x1 = x0 + 1;
+                double wx = fx - x0;
+                x0 = clamp_val(x0, 0, in.w - 1);
+                x1 = clamp_val(x1, 0, in.w - 1);
+
+                for (int ch = 0; ch < out.c; ++ch) {
+                    const int idx00 = ((y0*in.w + x0)*in.c + ch);
+                    const int idx10 = ((y0*in.w + x1)*in.c + ch);
+                    const int idx01 = ((y1*in.w + x0)*in.c + ch);
+                    const int idx11 = ((y1*in.w + x1)*in.c + ch);
+
+                    double v00 = in.data[idx00];
+                    double v10 = in.data[idx10];
+                    double v01 = in.data[idx01];
+                    double v11 = in.data[idx11];
+
+                    double v0 = v00 * (1.0 - wx) + v10 * wx;
+                    double v1 = v01 * (1.0 - wx) + v11 * wx;
+                    double v  = v0  * (1.0 - wy) + v1  * wy;
+
+                    store_sample(out.data[(static_cast<size_t>(y)*newW + x)*out.c + ch], static_cast<float>(v));
+                }
+            }
+        }
+    });
+    return out;
+}
+
+// --------------------- Bilinear resize (separable, fixed point) ---------------------
+// Same mapping and clamping as resize_bilinear_ref(), restructured:
+//   * per-column table: source offsets x0*c, x1*c and weight wx in Q11 (computed once per call)
+//   * per-row table:    y0, y1 and wy in Q11
+//   * horizontal pass into a row of Q11 intermediates, vertical pass combines two such rows:
+//       out = (h0*(2048-wy) + h1*wy + 2^21) >> 22
+//   * horizontal rows are cached: consecutive output rows usually share y0/y1, so each
+//     source row is resampled horizontally about once per band instead of once per output row.
+// Quantizing the weights to 1/2048 keeps results within +-1 of the double version.
+// 8-bit data has SIMD kernels for both passes (see below); they compute exactly the same
+// integers as the scalar loops, so output does not depend on the instruction set.
+static const int kBilinBits = 11;
+static const int kBilinOne  = 1 << kBilinBits;
+
+// g_scalar_kernels: force the general scalar loops — no SIMD kernels, no 2x/4x fast paths
+// (--scalar; used by --bench for comparison)
+static bool g_scalar_kernels = false;
+
+struct BilinTap { int o0, o1, w; };   // o0/o1: sample offsets (x*c) or row indices (y); w: Q11 weight of o1
+
+// f = (i+0.5)*srcN/dstN - 0.5 is evaluated as the exact fraction ((2i+1)*srcN - dstN) / (2*dstN):
+// integer part -> i0, remainder rounded to Q11 -> w. No floating point, so the taps (and the
+// 2x/4x identities below) hold whatever the compiler does with FMA.
+static vector<BilinTap> bilinear_taps(int srcN, int dstN, int stride) {
+    vector<BilinTap> t(dstN);
+    const long long den = 2LL * dstN;
+    for (int i = 0; i < dstN; ++i) {
+        const long long num = (2LL * i + 1) * srcN - dstN;
+        const long long q = num >= 0 ? num / den : -((-num + den - 1) / den);
+        const long long rem = num - q * den;   // 0 <= rem < den
+        const int i0 = static_cast<int>(q);
+        t[i].w  = static_cast<int>((rem * 2 * kBilinOne + den) / (2 * den));
+        t[i].o0 = clamp_val(i0, 0, srcN - 1) * stride;
+        t[i].o1 = clamp_val(i0 + 1, 0, srcN - 1) * stride;
+    }
+    return t;
+}
+
+// Horizontal taps plus the packed form used by the 8-bit SIMD kernels: every column reads the
+// adjacent pair (off, off+c) — a clamped edge tap (o0 == o1) becomes (o-c, o) with all weight
+// on o, which gives the same sum — and weights are stored as w0 | w1<<16 per output sample
+// (x*c + ch) so pmaddwd produces s0*w0 + s1*w1 directly.
+struct BilinX {
+    vector<BilinTap> taps;
+    vector<int32_t> off;    // per output column: byte offset of the left sample
+    vector<int32_t> wpk;    // per output sample: w0 | w1 << 16
+    int simdW = 0;          // columns [0, simdW) may be read with 8-byte loads at off[x]
+};
+
+static BilinX bilinear_x(int srcW, int dstW, int c) {
+    BilinX bx;
+    bx.taps = bilinear_taps(srcW, dstW, c);
+    bx.off.resize(dstW);
+    bx.wpk.resize(static_cast<size_t>(dstW) * c);
+    for (int x = 0; x < dstW; ++x) {
+        const BilinTap& t = bx.taps[x];
+        int off = t.o0, w0 = kBilinOne - t.w, w1 = t.w;
+        if (t.o0 == t.o1) {
+            if (t.o0 >= c) { off = t.o0 - c; w0 = 0; w1 = kBilinOne; }
+            else           { w0 = kBilinOne; w1 = 0; }
+        }
+        bx.off[x] = off;
+        for (int ch = 0; ch < c; ++ch) bx.wpk[static_cast<size_t>(x) * c + ch] = w0 | (w1 << 16);
+        if (srcW >= 2 && off + 8 <= srcW * c) bx.simdW = x + 1;   // off is non-decreasing
+    }
+    return bx;
+}
+
+// Accumulator wide enough for sample * 2^22 (8-bit fits 32 bits, 16-bit needs 64)
+template <typename T> struct BilinAcc;
+template <> struct BilinAcc<uint8_t>  { using type = uint32_t; };
+template <> struct BilinAcc<uint16_t> { using type = uint64_t; };
+
+template <typename T>
+static void bilinear_hrow_scalar(const T* src, const BilinX& bx, int c, int x, uint32_t* dst) {
+    const int W = static_cast<int>(bx.taps.size());
+    for (dst += static_cast<size_t>(x) * c; x < W; ++x) {
+        const T* p0 = src + bx.taps[x].o0;
+        const T* p1 = src + bx.taps[x].o1;
+        const uint32_t w1 = static_cast<uint32_t>(bx.taps[x].w), w0 = kBilinOne - w1;
+        for (int ch = 0; ch < c; ++ch) *dst++ = p0[ch] * w0 + p1[ch] * w1;
+    }
+}
+
+template <typename T>
+static void bilinear_hrow(const T* src, const BilinX& bx, int c, uint32_t* dst) {
+    bilinear_hrow_scalar(src, bx, c, 0, dst);
+}
+
+#if defined(__SSSE3__)
+// c=3, four output pixels: each 8-byte load at off[x] holds r0 g0 b0 r1 g1 b1 (+2 spare bytes);
+// pshufb turns two such loads into (s0, s1) word pairs in output-sample order, and pmaddwd
+// against the packed weights yields 12 finished Q11 samples.
+static inline void bilinear_rgb4(const uint8_t* src, const int32_t* off, const int32_t* wpk, uint32_t* dst) {
+    const __m128i a = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + off[0])),
+                                         _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + off[1])));
+    const __m128i b = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + off[2])),
+                                         _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + off[3])));
+    const __m128i s0  = _mm_shuffle_epi8(a, _mm_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, 8, -1, 11, -1));
+    const __m128i s1  = _mm_or_si128(
+        _mm_shuffle_epi8(a, _mm_setr_epi8(9, -1, 12, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 1, -1, 4, -1)));
+    const __m128i s2  = _mm_shuffle_epi8(b, _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 9, -1, 12, -1, 10, -1, 13, -1));
+    const __m128i* w = reinterpret_cast<const __m128i*>(wpk);
+    __m128i* d = reinterpret_cast<__m128i*>(dst);
+    _mm_storeu_si128(d + 0, _mm_madd_epi16(s0, _mm_loadu_si128(w + 0)));
+    _mm_storeu_si128(d + 1, _mm_madd_epi16(s1, _mm_loadu_si128(w + 1)));
+    _mm_storeu_si128(d + 2, _mm_madd_epi16(s2, _mm_loadu_si128(w + 2)));
+}
+#endif
+
+// 8-bit horizontal pass. c=1: AVX2 gathers the 16-bit pair at each off[x] (8 columns per step),
+// SSE2 builds the pairs with scalar 16-bit loads. c=3: bilinear_rgb4() (SSSE3). Other channel
+// counts and the columns past simdW use the scalar loop.
+static void bilinear_hrow(const uint8_t* src, const BilinX& bx, int c, uint32_t* dst) {
+    int x = 0;
+    if (!g_scalar_kernels) {
+        const int n = bx.simdW;
+        (void)n;   // unused without SSE2
+        if (c == 1) {
+#if defined(__AVX2__)
+            const __m256i pairs = _mm256_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+                                                   0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+            for (; x + 8 <= n; x += 8) {
+                const __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&bx.off[x]));
+                const __m256i g = _mm256_i32gather_epi32(reinterpret_cast<const int*>(src), idx, 1);
+                const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&bx.wpk[x]));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x),
+                                    _mm256_madd_epi16(_mm256_shuffle_epi8(g, pairs), w));
+            }
+#elif defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            for (; x + 8 <= n; x += 8) {
+                uint16_t p[8];
+                for (int k = 0; k < 8; ++k) memcpy(&p[k], src + bx.off[x + k], 2);
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                const __m128i* w = reinterpret_cast<const __m128i*>(&bx.wpk[x]);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+                                 _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), _mm_loadu_si128(w)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 4),
+                                 _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), _mm_loadu_si128(w + 1)));
+            }
+#endif
+        } else if (c == 3) {
+#if defined(__SSSE3__)
+            for (; x + 4 <= n; x += 4) bilinear_rgb4(src, &bx.off[x], &bx.wpk[3 * x], dst + 3 * x);
+#endif
+        }
+    }
+    bilinear_hrow_scalar(src, bx, c, x, dst);
+}
+
+template <typename T>
+static void bilinear_vrow_scalar(const uint32_t* h0, const uint32_t* h1, uint32_t wy, T* dst, size_t n) {
+    using Acc = typename BilinAcc<T>::type;
+    const Acc w1 = wy, w0 = kBilinOne - w1, round = Acc(1) << (2 * kBilinBits - 1);
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = static_cast<T>((h0[i] * w0 + h1[i] * w1 + round) >> (2 * kBilinBits));
+}
+
+template <typename T>
+static void bilinear_vrow(const uint32_t* h0, const uint32_t* h1, uint32_t wy, T* dst, size_t n) {
+    bilinear_vrow_scalar(h0, h1, wy, dst, n);
+}
+
+// 8-bit vertical pass: h < 2^19 and weights <= 2^11, so h0*w0 + h1*w1 + 2^21 < 2^31 and
+// 32-bit lanes (pmulld, SSE4.1 / AVX2) are exact.
+static void bilinear_vrow(const uint32_t* h0, const uint32_t* h1, uint32_t wy, uint8_t* dst, size_t n) {
+    size_t i = 0;
+    if (!g_scalar_kernels) {
+#if defined(__AVX2__)
+        const __m256i w0 = _mm256_set1_epi32(static_cast<int>(kBilinOne - wy)), w1 = _mm256_set1_epi32(static_cast<int>(wy));
+        const __m256i rnd = _mm256_set1_epi32(1 << (2 * kBilinBits - 1));
+        auto blend8 = [&](size_t k) {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h0 + k));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h1 + k));
+            return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(a, w0),
+                                                                       _mm256_mullo_epi32(b, w1)), rnd), 2 * kBilinBits);
+        };
+        for (; i + 16 <= n; i += 16) {
+            const __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi32(blend8(i), blend8(i + 8)), 0xD8);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                             _mm_packus_epi16(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1)));
+        }
+#elif defined(__SSE4_1__)
+        const __m128i w0 = _mm_set1_epi32(static_cast<int>(kBilinOne - wy)), w1 = _mm_set1_epi32(static_cast<int>(wy));
+        const __m128i rnd = _mm_set1_epi32(1 << (2 * kBilinBits - 1));
+        auto blend4 = [&](size_t k) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h0 + k));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h1 + k));
+            return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(a, w0), _mm_mullo_epi32(b, w1)), rnd),
+                                  2 * kBilinBits);
+        };
+        for (; i + 8 <= n; i += 8) {
+            const __m128i p = _mm_packus_epi32(blend4(i), blend4(i + 4));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(p, p));
+        }
+#endif
+    }
+    bilinear_vrow_scalar(h0 + i, h1 + i, wy, dst + i, n - i);
+}
+
+// --------------------- Bilinear 2x / 4x fast paths ---------------------
+// For exact ratios the general taps collapse to a few fixed weights, so these kernels skip the
+// tables and 32-bit intermediates and still produce the same integers as resize_bilinear():
+//   down k=2: fx = 2x + 0.5        -> pixels 2x, 2x+1, both weights 1024
+//   down k=4: fx = 4x + 1.5        -> pixels 4x+1, 4x+2, both weights 1024
+//             (bilinear samples the centre 2x2 of each 4x4 block; it is not a 16-pixel box)
+//     => out = (a + b + c + d + 2) >> 2 over that 2x2 block.
+//     pavgb is not used: avg(avg(a,b), avg(c,d)) rounds up twice and differs from
+//     (sum + 2) >> 2 in up to 1/4 of pixels; the kernels widen to 16 bits and add instead.
+//   up k=2: weights (1,3)/(3,1) per phase, out = (sum of products + 8) >> 4
+//   up k=4: weights (3,5)/(1,7)/(7,1)/(5,3), out = (sum + 32) >> 6
+//     (the Q11 weights are these small integers times 512 / 256, so the general formula
+//      (h0*w0 + h1*w1 + 2^21) >> 22 reduces exactly to the shifts above; edge clamping
+//      duplicates the border pixel in both)
+// 8-bit only; selected by resize_bilinear() when both axes have the same ratio.
+
+// down: row pointers r0/r1 already point at source rows k*y+o and k*y+o+1 (o = k/2-1)
+static void bilinear_down_row(const uint8_t* r0, const uint8_t* r1, int k, int c, uint8_t* dst, int outW) {
+    int x = 0;
+    const int o = k / 2 - 1;
+#if defined(__SSE2__)
+    const __m128i lo8 = _mm_set1_epi16(0x00FF), two = _mm_set1_epi16(2);
+    // sum of the two bytes in each 16-bit lane
+    auto pair16 = [&](__m128i v) { return _mm_add_epi16(_mm_and_si128(v, lo8), _mm_srli_epi16(v, 8)); };
+    if (c == 1 && k == 2) {
+        for (; x + 16 <= outW; x += 16) {
+            const __m128i* a = reinterpret_cast<const __m128i*>(r0 + 2 * x);
+            const __m128i* b = reinterpret_cast<const __m128i*>(r1 + 2 * x);
+            const __m128i s0 = _mm_add_epi16(pair16(_mm_loadu_si128(a)), pair16(_mm_loadu_si128(b)));
+            const __m128i s1 = _mm_add_epi16(pair16(_mm_loadu_si128(a + 1)), pair16(_mm_loadu_si128(b + 1)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+                             _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(s0, two), 2),
+                                              _mm_srli_epi16(_mm_add_epi16(s1, two), 2)));
+        }
+    } else if (c == 1 && k == 4) {
+        // bytes 1 and 2 of each 32-bit lane: shift them into one 16-bit lane pair
+        const __m128i lo16 = _mm_set1_epi32(0xFFFF);
+        auto mid = [&](const uint8_t* p) {
+            const __m128i v = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), 8), lo16);
+            return pair16(v);   // upper word of each lane is zero
+        };
+        for (; x + 8 <= outW; x += 8) {
+            const __m128i s0 = _mm_add_epi32(mid(r0 + 4 * x), mid(r1 + 4 * x));
+            const __m128i s1 = _mm_add_epi32(mid(r0 + 4 * x + 16), mid(r1 + 4 * x + 16));
+            const __m128i w = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(s0, s1), two), 2);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(w, w));
+        }
+    }
+#if defined(__SSSE3__)
+    else if (c == 3 && k == 2) {
+        // 8 source pixels -> 4 output pixels; pshufb pairs up (r0,r1)(g0,g1)(b0,b1)... per 16-bit lane
+        const __m128i mA = _mm_setr_epi8(0, 3, 1, 4, 2, 5, 6, 9, 7, 10, 8, 11, -1, -1, -1, -1);
+        const __m128i mB = _mm_setr_epi8(4, 7, 5, 8, 6, 9, 10, 13, 11, 14, 12, 15, -1, -1, -1, -1);
+        const __m128i compact = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+        auto half = [&](const uint8_t* p, const uint8_t* q, int off, __m128i m) {
+            const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off)), m);
+            const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(q + off)), m);
+            return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pair16(a), pair16(b)), two), 2);
+        };
+        // 16-byte store writes 4 bytes past the 12 produced: keep it inside the row
+        for (; x + 6 <= outW; x += 4) {
+            const __m128i v = _mm_packus_epi16(half(r0, r1, 6 * x, mA), half(r0, r1, 6 * x + 8, mB));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm_shuffle_epi8(v, compact));
+        }
+    }
+#endif
+#endif
+    for (; x < outW; ++x) {
+        const uint8_t* p0 = r0 + (k * x + o) * c;
+        const uint8_t* p1 = r1 + (k * x + o) * c;
+        for (int ch = 0; ch < c; ++ch)
+            dst[x * c + ch] = static_cast<uint8_t>((p0[ch] + p0[ch + c] + p1[ch] + p1[ch + c] + 2) >> 2);
+    }
+}
+
+// up: per-phase (left index offset, left weight); right weight = k*2 - left... expressed as
+// weights summing to 4 (k=2) or 8 (k=4)
+struct RatioPhase { int d, wl, wr; };   // left source = j + d (right = left + 1), weights
+static const RatioPhase kUp2[2] = { { -1, 1, 3 }, { 0, 3, 1 } };
+static const RatioPhase kUp4[4] = { { -1, 3, 5 }, { -1, 1, 7 }, { 0, 7, 1 }, { 0, 5, 3 } };
+
+static void bilinear_up_hrow(const uint8_t* src, int srcW, int k, int c, uint16_t* dst) {
+    const RatioPhase* ph = (k == 2) ? kUp2 : kUp4;
+    for (int j = 0; j < srcW; ++j) {
+        for (int p = 0; p < k; ++p) {
+            const int l = clamp_val(j + ph[p].d, 0, srcW - 1), r = clamp_val(j + ph[p].d + 1, 0, srcW - 1);
+            const uint8_t* a = src + l * c;
+            const uint8_t* b = src + r * c;
+            for (int ch = 0; ch < c; ++ch) *dst++ = static_cast<uint16_t>(a[ch] * ph[p].wl + b[ch] * ph[p].wr);
+        }
+    }
+}
+
+static void bilinear_up_vrow(const uint16_t* h0, const uint16_t* h1, int w0, int w1, int shift, uint8_t* dst, size_t n) {
+    size_t i = 0;
+    const int rnd = 1 << (shift - 1);
+#if defined(__SSE2__)
+    // h <= 255*8, h0*w0 + h1*w1 + rnd <= 2040*8 + 32: fits signed 16-bit
+    const __m128i vw0 = _mm_set1_epi16(static_cast<short>(w0)), vw1 = _mm_set1_epi16(static_cast<short>(w1));
+    const __m128i vr = _mm_set1_epi16(static_cast<short>(rnd));
+    const __m128i vs = _mm_cvtsi32_si128(shift);
+    for (; i + 16 <= n; i += 16) {
+        __m128i r[2];
+        for (int q = 0; q < 2; ++q) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h0 + i + 8 * q));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h1 + i + 8 * q));
+            r[q] = _mm_srl_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, vw0), _mm_mullo_epi16(b, vw1)), vr), vs);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(r[0], r[1]));
+    }
+#endif
+    for (; i < n; ++i) dst[i] = static_cast<uint8_t>((h0[i] * w0 + h1[i] * w1 + rnd) >> shift);
+}
+
+// resize_bilinear_ratio(in, newW, newH, out): runs a 2x/4x kernel when the ratio fits
+// (same integer factor on both axes) and returns true; false leaves out untouched.
+static bool resize_bilinear_ratio(const Image& in, int newW, int newH, Image& out) {
+    int k = 0;
+    bool down = false;
+    for (int f : { 2, 4 }) {
+        if (in.w == f * newW && in.h == f * newH) { k = f; down = true; }
+        else if (newW == f * in.w && newH == f * in.h) { k = f; down = false; }
+    }
+    if (k == 0) return false;
+    out.w = newW; out.h = newH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(newW) * newH * in.c);
+    const int c = in.c;
+    const size_t srcRow = static_cast<size_t>(in.w) * c;
+    const size_t rowN = static_cast<size_t>(newW) * c;
+
+    if (down) {
+        const int o = k / 2 - 1;
+        parallel_bands(newH, resize_band_rows(in.h, newH, srcRow, 2), [&](int y0, int y1) {
+            for (int y = y0; y < y1; ++y)
+                bilinear_down_row(&in.data[srcRow * (k * y + o)], &in.data[srcRow * (k * y + o + 1)], k, c,
+                                  &out.data[rowN * y], newW);
+        });
+        return true;
+    }
+
+    const RatioPhase* ph = (k == 2) ? kUp2 : kUp4;
+    const int shift = (k == 2) ? 4 : 6;
+    parallel_bands(newH, resize_band_rows(in.h, newH, srcRow, 2), [&](int ya, int yb) {
+        uint16_t* h0 = scratch_buffer<uint16_t>(0, rowN);
+        uint16_t* h1 = scratch_buffer<uint16_t>(1, rowN);
+        int have0 = -1, have1 = -1;
+        for (int y = ya; y < yb; ++y) {
+            const RatioPhase& p = ph[y % k];
+            const int sy0 = clamp_val(y / k + p.d, 0, in.h - 1), sy1 = clamp_val(y / k + p.d + 1, 0, in.h - 1);
+            if (have0 != sy0) {
+                if (have1 == sy0) { swap(h0, h1); swap(have0, have1); }
+                else { bilinear_up_hrow(&in.data[srcRow * sy0], in.w, k, c, h0); have0 = sy0; }
+            }
+            if (have1 != sy1) { bilinear_up_hrow(&in.data[srcRow * sy1], in.w, k, c, h1); have1 = sy1; }
+            bilinear_up_vrow(h0, h1, p.wl, p.wr, shift, &out.data[rowN * y], rowN);
+        }
+    });
+    return true;
+}
+
+template <typename T>
+static bool resize_bilinear_ratio(const ImageT<T>&, int, int, ImageT<T>&) { return false; }
+
+template <typename T>
+static ImageT<T> resize_bilinear(const ImageT<T>& in, int newW, int newH) {
+    ImageT<T> out;
+    if (!g_scalar_kernels && resize_bilinear_ratio(in, newW, newH, out)) return out;
+    out.w = newW; out.h = newH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
+    const BilinX bx = bilinear_x(in.w, newW, in.c);
+    const vector<BilinTap> yt = bilinear_taps(in.h, newH, 1);
+    const size_t srcRow = static_cast<size_t>(in.w) * in.c;
+    const size_t rowN = static_cast<size_t>(newW) * out.c;
+
+    parallel_bands(newH, resize_band_rows(in.h, newH, srcRow * sizeof(T), 2), [&](int ya, int yb) {
+        uint32_t* h0 = scratch_buffer<uint32_t>(0, rowN);
+        uint32_t* h1 = scratch_buffer<uint32_t>(1, rowN);
+        int have0 = -1, have1 = -1;   // source rows currently held in h0 / h1
+        for (int y = ya; y < yb; ++y) {
+            const int sy0 = yt[y].o0, sy1 = yt[y].o1;
+            if (have0 != sy0) {
+                if (have1 == sy0) { swap(h0, h1); swap(have0, have1); }
+                else { bilinear_hrow(&in.data[srcRow * sy0], bx, in.c, h0); have0 = sy0; }
+            }
+            if (have1 != sy1) { bilinear_hrow(&in.data[srcRow * sy1], bx, in.c, h1); have1 = sy1; }
+            bilinear_vrow(h0, h1, static_cast<uint32_t>(yt[y].w), &out.data[rowN * y], rowN);
+        }
+    });
+    return out;
+}
+
+// --------------------- Area resize ---------------------
+// resize_area(in, newW, newH): each output pixel is the exact average of the source area its
+// footprint covers (pixel-area relation), so large downscales do not alias and need no
+// multi-step pyramid. Separable, vertical first:
+//   * per-axis tap lists: output i covers [i*src/dst, (i+1)*src/dst); a source pixel's weight is
+//     its overlap, computed exactly in units of 1/dst and rounded to Q12, then the largest tap
+//     absorbs the rounding so every output's weights sum to exactly 4096
+//   * vertical pass: the source rows of one output row are accumulated into a running-sum row
+//     buffer, sum += row * wy (contiguous, SIMD); rows are visited in order, so this streams
+//   * horizontal pass, once per output row: out = (sum over taps of vsum * wx + 2^23) >> 24
+// 8-bit sums stay below 255 * 2^24 < 2^32; 16-bit data finishes in 64 bits.
+// Upscaled axes degrade gracefully (one or two taps per output: nearest with blended seams).
+static const int kAreaBits = 12;
+
+struct AreaTaps {
+    vector<int> start, count;   // per output: taps [start, start+count)
+    vector<int> idx;            // source index (times stride)
+    vector<uint32_t> w;         // Q12 weight
+};
+
+static AreaTaps area_taps(int srcN, int dstN, int stride) {
+    AreaTaps t;
+    t.start.resize(dstN); t.count.resize(dstN);
+    const long long one = 1LL << kAreaBits;
+    for (int i = 0; i < dstN; ++i) {
+        // footprint and source pixels in units of 1/dstN
+        const long long lo = static_cast<long long>(i) * srcN, hi = lo + srcN;
+        t.start[i] = static_cast<int>(t.idx.size());
+        long long sum = 0;
+        size_t big = t.w.size();
+        for (long long j = lo / dstN; j * dstN < hi; ++j) {
+            const long long ov = min(hi, (j + 1) * dstN) - max(lo, j * dstN);
+            const uint32_t w = static_cast<uint32_t>((ov * one * 2 + srcN) / (2LL * srcN));
+            if (w == 0) continue;
+            if (t.w.size() == big || w > t.w[big]) big = t.w.size();
+            t.idx.push_back(static_cast<int>(j) * stride);
+            t.w.push_back(w);
+            sum += w;
+        }
+        t.w[big] = static_cast<uint32_t>(t.w[big] + (one - sum));
+        t.count[i] = static_cast<int>(t.idx.size()) - t.start[i];
+    }
+    return t;
+}
+
+// vsum = (first ? 0 : vsum) + row * w
+template <typename T>
+static void area_vaccum(uint32_t* vsum, const T* row, uint32_t w, size_t n, bool first) {
+    for (size_t i = 0; i < n; ++i) vsum[i] = (first ? 0u : vsum[i]) + row[i] * w;
+}
+
+// 8-bit: products <= 255 * 4096 need 32 bits; SSE2 forms them from pmullw / pmulhuw halves
+static void area_vaccum(uint32_t* vsum, const uint8_t* row, uint32_t w, size_t n, bool first) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), vw = _mm_set1_epi16(static_cast<short>(w));
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        const __m128i p[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+        __m128i* d = reinterpret_cast<__m128i*>(vsum + i);
+        for (int q = 0; q < 2; ++q) {
+            const __m128i lo = _mm_mullo_epi16(p[q], vw), hi = _mm_mulhi_epu16(p[q], vw);
+            __m128i a = _mm_unpacklo_epi16(lo, hi), b = _mm_unpackhi_epi16(lo, hi);
+            if (!first) {
+                a = _mm_add_epi32(a, _mm_loadu_si128(d + 2 * q));
+                b = _mm_add_epi32(b, _mm_loadu_si128(d + 2 * q + 1));
+            }
+            _mm_storeu_si128(d + 2 * q, a);
+            _mm_storeu_si128(d + 2 * q + 1, b);
+        }
+    }
+#endif
+    for (; i < n; ++i) vsum[i] = (first ? 0u : vsum[i]) + row[i] * w;
+}
+
+template <typename T>
+static void area_hrow(const uint32_t* vsum, const AreaTaps& xt, int c, T* dst) {
+    using Acc = typename BilinAcc<T>::type;   // 32 bits for 8-bit samples, 64 for 16-bit
+    const Acc rnd = Acc(1) << (2 * kAreaBits - 1);
+    const int W = static_cast<int>(xt.start.size());
+    for (int x = 0; x < W; ++x, dst += c) {
+        const int* ix = &xt.idx[xt.start[x]];
+        const uint32_t* wx = &xt.w[xt.start[x]];
+        const int n = xt.count[x];
+        if (c == 3) {
+            Acc s0 = rnd, s1 = rnd, s2 = rnd;
+            for (int k = 0; k < n; ++k) {
+                const uint32_t* p = vsum + ix[k];
+                s0 += static_cast<Acc>(p[0]) * wx[k]; s1 += static_cast<Acc>(p[1]) * wx[k];
+                s2 += static_cast<Acc>(p[2]) * wx[k];
+            }
+            dst[0] = static_cast<T>(s0 >> (2 * kAreaBits));
+            dst[1] = static_cast<T>(s1 >> (2 * kAreaBits));
+            dst[2] = static_cast<T>(s2 >> (2 * kAreaBits));
+        } else {
+            for (int ch = 0; ch < c; ++ch) {
+                Acc s = rnd;
+                for (int k = 0; k < n; ++k) s += static_cast<Acc>(vsum[ix[k] + ch]) * wx[k];
+                dst[ch] = static_cast<T>(s >> (2 * kAreaBits));
+            }
+        }
+    }
+}
+
+template <typename T>
+static ImageT<T> resize_area(const ImageT<T>& in, int newW, int newH) {
+    ImageT<T> out; out.w = newW; out.h = newH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
+    const AreaTaps xt = area_taps(in.w, newW, in.c);
+    const AreaTaps yt = area_taps(in.h, newH, 1);
+    const size_t srcRow = static_cast<size_t>(in.w) * in.c;
+    const size_t rowN = static_cast<size_t>(newW) * out.c;
+
+    const int support = (in.h + newH - 1) / newH + 1;
+    parallel_bands(newH, resize_band_rows(in.h, newH, srcRow * sizeof(T), support), [&](int ya, int yb) {
+        uint32_t* vsum = scratch_buffer<uint32_t>(0, srcRow);
+        for (int y = ya; y < yb; ++y) {
+            for (int k = 0; k < yt.count[y]; ++k)
+                area_vaccum(vsum, &in.data[srcRow * yt.idx[yt.start[y] + k]], yt.w[yt.start[y] + k], srcRow, k == 0);
+            area_hrow(vsum, xt, in.c, &out.data[rowN * y]);
+        }
+    });
+    return out;
+}
+
+// --------------------- Bicubic / Lanczos resize ---------------------
+// resize_filtered(in, newW, newH, kernel): separable convolution resampler, same pixel-centered
+// mapping as the others (center = (i+0.5)*s - 0.5, s = src/dst).
+//   bicubic:  Keys cubic, a = -0.5, radius 2
+//   lanczos3: sinc(x) * sinc(x/3), radius 3
+// Downscaling stretches the kernel by s (radius*s source pixels, argument divided by s) so it
+// also acts as the antialiasing filter; upscaling uses the kernel as is.
+// Weights are tabulated once per axis (fixed tap count per output, padded with zeros to a multiple
+// of 4, normalized to sum 1). The horizontal pass reads a float copy of the source row with the
+// edge pixels replicated into a margin, so every tap is a contiguous load; horizontally filtered
+// rows live in a ring of n rows keyed by source row, and the vertical pass combines them with
+// SSE float multiply-adds, rounding half to even (cvtps2dq) and saturating.
+enum class ResizeKernel { Bicubic, Lanczos3 };
+
+static double kernel_radius(ResizeKernel k) { return k == ResizeKernel::Bicubic ? 2.0 : 3.0; }
+
+static double kernel_eval(ResizeKernel k, double x) {
+    x = fabs(x);
+    if (k == ResizeKernel::Bicubic) {
+        const double a = -0.5;
+        if (x <= 1.0) return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        if (x < 2.0)  return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+        return 0.0;
+    }
+    if (x < 1e-8) return 1.0;
+    if (x >= 3.0) return 0.0;
+    const double px = 3.14159265358979323846 * x;
+    return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+struct FilterTaps {
+    int n = 0;                 // taps per output (multiple of 4)
+    vector<int> start;         // first source index per output (may be < 0 or run past the end)
+    vector<float> w;           // n weights per output
+};
+
+static FilterTaps filter_taps(int srcN, int dstN, ResizeKernel k) {
+    FilterTaps t;
+    const double s = static_cast<double>(srcN) / dstN;
+    const double stretch = max(1.0, s);
+    const double radius = kernel_radius(k) * stretch;
+    t.n = (static_cast<int>(ceil(2.0 * radius)) + 1 + 3) & ~3;
+    t.start.resize(dstN);
+    t.w.assign(static_cast<size_t>(dstN) * t.n, 0.0f);
+    vector<double> w(t.n);
+    for (int i = 0; i < dstN; ++i) {
+        const double center = (i + 0.5) * s - 0.5;
+        const int first = static_cast<int>(floor(center - radius)) + 1;
+        double sum = 0.0;
+        for (int j = 0; j < t.n; ++j) {
+            w[j] = kernel_eval(k, (first + j - center) / stretch);
+            sum += w[j];
+        }
+        t.start[i] = first;
+        for (int j = 0; j < t.n; ++j) t.w[static_cast<size_t>(i) * t.n + j] = static_cast<float>(w[j] / sum);
+    }
+    return t;
+}
+
+// prow points at source column 0 of a float row with a replicated margin on both sides
+// (and one spare float at the end for the 4-wide c=3 loads)
+static void filter_hrow(const float* prow, const FilterTaps& xt, int c, float* dst) {
+    const int W = static_cast<int>(xt.start.size());
+    const int n = xt.n;
+    for (int x = 0; x < W; ++x) {
+        const float* p = prow + static_cast<ptrdiff_t>(xt.start[x]) * c;
+        const float* w = &xt.w[static_cast<size_t>(x) * n];
+#if defined(__SSE2__)
+        if (c == 1) {
+            __m128 acc = _mm_setzero_ps();
+            for (int k = 0; k < n; k += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(p + k), _mm_loadu_ps(w + k)));
+            acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+            acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+            dst[x] = _mm_cvtss_f32(acc);
+            continue;
+        }
+        if (c == 3) {
+            __m128 acc = _mm_setzero_ps();   // lanes r, g, b, (next pixel's r: ignored)
+            for (int k = 0; k < n; ++k) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(p + 3 * k), _mm_set1_ps(w[k])));
+            float v[4];
+            _mm_storeu_ps(v, acc);
+            dst[3 * x] = v[0]; dst[3 * x + 1] = v[1]; dst[3 * x + 2] = v[2];
+            continue;
+        }
+#endif
+        for (int ch = 0; ch < c; ++ch) {
+            float acc = 0.0f;
+            for (int k = 0; k < n; ++k) acc += p[k * c + ch] * w[k];
+            dst[x * c + ch] = acc;
+        }
+    }
+}
+
+template <typename T>
+static void filter_vrow(const float* const* rows, const float* w, int n, T* dst, size_t len) {
+    const float top = 65535.0f;   // 16-bit samples (8-bit has its own overload)
+    for (size_t i = 0; i < len; ++i) {
+        float acc = 0.0f;
+        for (int k = 0; k < n; ++k) acc += rows[k][i] * w[k];
+        dst[i] = static_cast<T>(lrintf(clamp_val(acc, 0.0f, top)));
+    }
+}
+
+static void filter_vrow(const float* const* rows, const float* w, int n, uint8_t* dst, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 8 <= len; i += 8) {
+        __m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+        for (int k = 0; k < n; ++k) {
+            const __m128 wk = _mm_set1_ps(w[k]);
+            a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(rows[k] + i), wk));
+            b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(rows[k] + i + 4), wk));
+        }
+        const __m128i q = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(q, q));
+    }
+#endif
+    for (; i < len; ++i) {
+        float acc = 0.0f;
+        for (int k = 0; k < n; ++k) acc += rows[k][i] * w[k];
+        dst[i] = static_cast<uint8_t>(lrintf(clamp_val(acc, 0.0f, 255.0f)));
+    }
+}
+
+template <typename T>
+static ImageT<T> resize_filtered(const ImageT<T>& in, int newW, int newH, ResizeKernel kern) {
+    ImageT<T> out; out.w = newW; out.h = newH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(newW) * newH * out.c);
+    const FilterTaps xt = filter_taps(in.w, newW, kern);
+    const FilterTaps yt = filter_taps(in.h, newH, kern);
+    const int c = in.c;
+    // margin: enough replicated pixels for the farthest tap on either side
+    int margin = 1;
+    for (int x = 0; x < newW; ++x) margin = max(margin, max(-xt.start[x], xt.start[x] + xt.n - in.w) + 1);
+    const size_t rowN = static_cast<size_t>(newW) * c;
+    const int ny = yt.n;
+
+    const size_t srcRowBytes = static_cast<size_t>(in.w) * c * sizeof(T);
+    parallel_bands(newH, resize_band_rows(in.h, newH, srcRowBytes, ny), [&](int ya, int yb) {
+        const size_t padN = (static_cast<size_t>(in.w) + 2 * margin) * c + 1;
+        float* padded = scratch_buffer<float>(0, padN);
+        padded[padN - 1] = 0.0f;
+        float* prow = padded + static_cast<size_t>(margin) * c;
+        float* ring = scratch_buffer<float>(1, static_cast<size_t>(ny) * rowN);
+        vector<int> tag(ny, INT32_MIN);   // source row (unclamped) held by each ring slot
+        vector<const float*> rows(ny);
+        for (int y = ya; y < yb; ++y) {
+            for (int k = 0; k < ny; ++k) {
+                const int j = yt.start[y] + k;
+                const int slot = ((j % ny) + ny) % ny;
+                float* r = &ring[static_cast<size_t>(slot) * rowN];
+                if (tag[slot] != j) {
+                    const T* s = &in.data[static_cast<size_t>(clamp_val(j, 0, in.h - 1)) * in.w * c];
+                    for (size_t i = 0; i < static_cast<size_t>(in.w) * c; ++i) prow[i] = s[i];
+                    for (int m = 1; m <= margin; ++m) {
+                        for (int ch = 0; ch < c; ++ch) {
+                            prow[-m * c + ch] = prow[ch];
+                            prow[(in.w - 1 + m) * c + ch] = prow[(in.w - 1) * c + ch];
+                        }
+                    }
+                    filter_hrow(prow, xt, c, r);
+                    tag[slot] = j;
+                }
+                rows[k] = r;
+            }
+            filter_vrow(rows.data(), &yt.w[static_cast<size_t>(y) * ny], ny, &out.data[rowN * y], rowN);
+        }
+    });
+    return out;
+}
+
+// --------------------- Pyramids ---------------------
+// build_pyramid(in, filter, levels): reduced levels 1..n of `in` (level 0 is the input itself);
+// each level is the previous one halved, ceil(w/2) x ceil(h/2), down to 1x1 or `levels` levels.
+//   box:      2x2 mean, (a+b+c+d+2) >> 2
+//   gaussian: separable binomial [1 5 10 10 5 1] / 32 per axis (sigma ~1.1), (sum + 512) >> 10
+// Both filters are centered between source pixels 2i and 2i+1, i.e. the pixel-centered mapping of
+// resize; borders (and the missing pixel of odd sizes) replicate the edge.
+// One cascaded pass: whenever a level gains a row, the next level makes every row whose support
+// is now complete, so each row is reduced again while it is still in cache instead of every level
+// being re-read from memory. Per output row: vertical pass over the needed source rows into a
+// uint32 row (u8: SSE2 16-bit lanes), then a horizontal pass that decimates it.
+enum class PyramidFilter { Gaussian, Box };
+
+static const uint32_t kPyrGauss[6] = { 1, 5, 10, 10, 5, 1 };
+static const uint32_t kPyrBox[2] = { 1, 1 };
+
+template <typename T>
+static void pyr_vrow(const T* const* rows, const uint32_t* w, int n, size_t len, uint32_t* dst) {
+    for (size_t i = 0; i < len; ++i) {
+        uint32_t s = 0;
+        for (int k = 0; k < n; ++k) s += rows[k][i] * w[k];
+        dst[i] = s;
+    }
+}
+
+// u8: weights sum to at most 32, so 32 * 255 fits a 16-bit lane
+static void pyr_vrow(const uint8_t* const* rows, const uint32_t* w, int n, size_t len, uint32_t* dst) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i lo = zero, hi = zero;
+        for (int k = 0; k < n; ++k) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + i));
+            const __m128i wk = _mm_set1_epi16(static_cast<short>(w[k]));
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), wk));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), wk));
+        }
+        __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+        _mm_storeu_si128(d,     _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(hi, zero));
+    }
+#endif
+    for (; i < len; ++i) {
+        uint32_t s = 0;
+        for (int k = 0; k < n; ++k) s += rows[k][i] * w[k];
+        dst[i] = s;
+    }
+}
+
+// Horizontal pass: output pixel x reads source columns 2x-off .. 2x-off+n-1 (clamped).
+template <typename T>
+static void pyr_hrow(const uint32_t* v, int srcW, int c, const uint32_t* w, int n, int shift, T* dst, int dstW) {
+    const int off = n / 2 - 1;
+    const uint32_t half = 1u << (shift - 1);
+    // interior: every tap inside the row, no clamping
+    const int x0 = min(dstW, (off + 1) / 2), x1 = max(x0, srcW < n - off ? 0 : min(dstW, (srcW - n + off) / 2 + 1));
+    auto edge = [&](int x) {
+        for (int ch = 0; ch < c; ++ch) {
+            uint32_t s = 0;
+            for (int k = 0; k < n; ++k) s += v[clamp_val(2 * x - off + k, 0, srcW - 1) * c + ch] * w[k];
+            dst[x * c + ch] = static_cast<T>((s + half) >> shift);
+        }
+    };
+    for (int x = 0; x < x0; ++x) edge(x);
+    for (int x = x0; x < x1; ++x) {
+        const uint32_t* p = v + (2 * x - off) * c;
+        for (int ch = 0; ch < c; ++ch) {
+            uint32_t s = 0;
+            for (int k = 0; k < n; ++k) s += p[k * c + ch] * w[k];
+            dst[x * c + ch] = static_cast<T>((s + half) >> shift);
+        }
+    }
+    for (int x = x1; x < dstW; ++x) edge(x);
+}
+
+template <typename T>
+static vector<ImageT<T>> build_pyramid(const ImageT<T>& in, PyramidFilter f, int levels) {
+    vector<ImageT<T>> out;
+    if (in.empty()) return out;
+    for (int w = in.w, h = in.h; (w > 1 || h > 1) && (levels <= 0 || static_cast<int>(out.size()) < levels);) {
+        w = (w + 1) / 2; h = (h + 1) / 2;
+        out.emplace_back();
+        out.back().w = w; out.back().h = h; out.back().c = in.c;
+        out.back().data.resize(static_cast<size_t>(w) * h * in.c);
+    }
+    const int nl = static_cast<int>(out.size());
+    const bool box = (f == PyramidFilter::Box);
+    const int n = box ? 2 : 6, off = n / 2 - 1, shift = box ? 2 : 10;
+    const uint32_t* wk = box ? kPyrBox : kPyrGauss;
+    const int c = in.c;
+
+    auto parent = [&](int L) -> const ImageT<T>& { return L == 0 ? in : out[L - 1]; };
+    vector<int> done(nl, 0);                               // rows finished per level
+    vector<uint32_t> vsum(static_cast<size_t>(in.w) * c);  // vertical sums of the widest parent
+    auto ready = [&](int L) {
+        const int y = done[L];
+        if (y >= out[L].h) return false;
+        const ImageT<T>& p = parent(L);
+        return min(2 * y - off + n - 1, p.h - 1) < (L == 0 ? p.h : done[L - 1]);
+    };
+    auto make_row = [&](int L) {
+        const ImageT<T>& p = parent(L);
+        ImageT<T>& o = out[L];
+        const int y = done[L]++;
+        const size_t pRow = static_cast<size_t>(p.w) * c;
+        const T* rows[6];
+        for (int k = 0; k < n; ++k) rows[k] = &p.data[pRow * clamp_val(2 * y - off + k, 0, p.h - 1)];
+        pyr_vrow(rows, wk, n, pRow, vsum.data());
+        pyr_hrow(vsum.data(), p.w, c, wk, n, shift, &o.data[static_cast<size_t>(o.w) * c * y], o.w);
+    };
+    while (nl > 0 && ready(0)) {
+        make_row(0);
+        for (int L = 1; L < nl; ++L)
+            while (ready(L)) make_row(L);
+    }
+    return out;
+}
+
+// write_pyramid(path, levels, tile): tiled pyramid container (.pyr), all integers little-endian:
+//   "PYR1", u32 level count, u32 channels, u32 tile size
+//   per level: u32 w, u32 h, u64 file offset of its first tile
+//   then each level's tiles in row-major tile order; a tile is tile x tile pixels, row-major and
+//   interleaved, zero-padded past the right / bottom edge. Tile (tx, ty) of a level therefore
+//   starts at offset + (ty * ceil(w / tile) + tx) * tile * tile * c.
+static bool write_pyramid(const string& path, const vector<const Image*>& levels, int tile) {
+    if (levels.empty() || tile <= 0) return false;
+    ofstream out(path, ios::binary);
+    if (!out) { cerr << "Cannot write " << path << "\n"; return false; }
+    auto wr_u32 = [&](uint32_t v) { for (int b = 0; b < 4; ++b) out.put(static_cast<char>((v >> (8 * b)) & 0xFF)); };
+    const int c = levels[0]->c;
+    const size_t tileBytes = static_cast<size_t>(tile) * tile * c;
+    auto tiles_of = [&](const Image& im) {
+        return static_cast<uint64_t>((im.w + tile - 1) / tile) * ((im.h + tile - 1) / tile);
+    };
+    out.write("PYR1", 4);
+    wr_u32(static_cast<uint32_t>(levels.size()));
+    wr_u32(static_cast<uint32_t>(c));
+    wr_u32(static_cast<uint32_t>(tile));
+    uint64_t offset = 16 + 16 * levels.size();
+    for (const Image* im : levels) {
+        wr_u32(static_cast<uint32_t>(im->w));
+        wr_u32(static_cast<uint32_t>(im->h));
+        wr_u32(static_cast<uint32_t>(offset));
+        wr_u32(static_cast<uint32_t>(offset >> 32));
+        offset += tiles_of(*im) * tileBytes;
+    }
+    vector<char> buf(tileBytes);
+    for (const Image* im : levels) {
+        const size_t row = static_cast<size_t>(im->w) * c;
+        for (int ty = 0; ty < im->h; ty += tile) {
+            for (int tx = 0; tx < im->w; tx += tile) {
+                fill(buf.begin(), buf.end(), 0);
+                const int tw = min(tile, im->w - tx), th = min(tile, im->h - ty);
+                for (int y = 0; y < th; ++y)
+                    memcpy(&buf[static_cast<size_t>(y) * tile * c], &im->data[row * (ty + y) + static_cast<size_t>(tx) * c],
+                           static_cast<size_t>(tw) * c);
+                out.write(buf.data(), buf.size());
+            }
+        }
+    }
+    return static_cast<bool>(out);
+}
+
+// --------------------- Affine warp ---------------------
+// warp_affine(in, m, outW, outH, interp, fill): out(x, y) = in(m^-1 (x, y)), m a 2x3 forward map
+// from source to output coordinates (pixel (i, j) covers [i, i+1) x [j, j+1)). Pixel-centered like
+// resize: output centre (x+0.5, y+0.5) maps back to sample position (fx, fy) = m^-1(...) - 0.5.
+// The source covers [0, w) x [0, h); outside it the output is `fill`. Bilinear taps at the border
+// replicate the edge (as in resize) and use the same Q11 weights and rounding as resize_bilinear().
+//   * coordinates are Q16 fixed point, stepped incrementally along the row (one add per pixel per
+//     axis) and re-anchored from the exact double every kWarpBlock columns, so they stay within
+//     2^-11 px of exact whatever the width
+//   * each row is clipped analytically against the source: columns mapping outside are filled
+//     without sampling, a column or two at each edge of the covered span are bounds-checked, and
+//     the interior (where every tap is in range) runs unchecked — 8-bit c=1 / c=3 with AVX2
+//     gathers, 8 pixels per step
+//   * output is split into kWarpTileW x kWarpTileH tiles on the thread pool; a short, wide tile
+//     keeps the source lines it touches cached for any angle, where whole rotated rows would
+//     sweep the source and evict them before the next row comes back to them
+// Sources are limited to 32767 x 32767 (Q16 coordinates in 32-bit lanes).
+struct Affine { double a = 1, b = 0, c = 0, d = 0, e = 1, f = 0; };   // x' = a*x + b*y + c, y' = d*x + e*y + f
+
+enum class WarpInterp { Nearest, Bilinear };
+
+static const int kWarpBlock = 64;
+static const int kWarpTileW = 256, kWarpTileH = 8;   // parallel unit (multiple of kWarpBlock wide)
+static const double kWarpEps = 1.0 / 256;   // interior margin (> worst-case fixed-point drift)
+
+// affine_mul(p, q): p after q
+static Affine affine_mul(const Affine& p, const Affine& q) {
+    Affine r;
+    r.a = p.a * q.a + p.b * q.d;  r.b = p.a * q.b + p.b * q.e;  r.c = p.a * q.c + p.b * q.f + p.c;
+    r.d = p.d * q.a + p.e * q.d;  r.e = p.d * q.b + p.e * q.e;  r.f = p.d * q.c + p.e * q.f + p.f;
+    return r;
+}
+
+// affine_invert(m, inv): false if m is (numerically) singular
+static bool affine_invert(const Affine& m, Affine& inv) {
+    const double det = m.a * m.e - m.b * m.d;
+    if (!(fabs(det) > 1e-12)) return false;
+    inv.a =  m.e / det;  inv.b = -m.b / det;  inv.c = (m.b * m.f - m.e * m.c) / det;
+    inv.d = -m.d / det;  inv.e =  m.a / det;  inv.f = (m.d * m.c - m.a * m.f) / det;
+    return true;
+}
+
+// affine_fit(m, w, h, W, H): shifts m so the image of [0,w) x [0,h) starts at (0, 0) and returns the
+// smallest output size holding all of it (e.g. the bounding box of a rotated image)
+static void affine_fit(Affine& m, int w, int h, int& W, int& H) {
+    double x0 = 1e300, x1 = -1e300, y0 = 1e300, y1 = -1e300;
+    for (int k = 0; k < 4; ++k) {
+        const double x = (k & 1) ? w : 0, y = (k & 2) ? h : 0;
+        const double u = m.a * x + m.b * y + m.c, v = m.d * x + m.e * y + m.f;
+        x0 = min(x0, u); x1 = max(x1, u); y0 = min(y0, v); y1 = max(y1, v);
+    }
+    m.c -= x0; m.f -= y0;
+    W = max(1, static_cast<int>(ceil(x1 - x0 - 1e-6)));
+    H = max(1, static_cast<int>(ceil(y1 - y0 - 1e-6)));
+}
+
+// Output -> sample-position map: fx = ax*x + bx*y + cx, fy = ay*x + by*y + cy for output pixel
+// (x, y); nearest folds in +0.5 so the source index is simply floor(f).
+struct WarpMap {
+    double ax, bx, cx, ay, by, cy;
+    int64_t dqx, dqy;   // Q16 steps per output column
+};
+
+// warp_clip(a, p, lo, hi, x0, x1): narrows the real interval [x0, x1] to the x with lo <= a*x + p <= hi
+// (empty when lo > hi, e.g. the bilinear interior of a source one pixel wide or tall)
+static void warp_clip(double a, double p, double lo, double hi, double& x0, double& x1) {
+    if (lo > hi) {
+        x1 = x0 - 1;
+        return;
+    }
+    if (fabs(a) < 1e-12) {
+        if (p < lo || p > hi) x1 = x0 - 1;
+        return;
+    }
+    double s = (lo - p) / a, t = (hi - p) / a;
+    if (s > t) swap(s, t);
+    x0 = max(x0, s); x1 = min(x1, t);
+}
+
+// Edge pixel: bounds-checked, fill outside [0,w) x [0,h), clamped (replicated) bilinear taps.
+template <typename T>
+static void warp_px_checked(const ImageT<T>& in, WarpInterp mode, int64_t qx, int64_t qy, T fill, T* dst) {
+    const int c = in.c;
+    const bool nn = mode == WarpInterp::Nearest;
+    const int64_t ux = (nn ? qx : qx + 0x8000) >> 16, uy = (nn ? qy : qy + 0x8000) >> 16;
+    if (ux < 0 || uy < 0 || ux >= in.w || uy >= in.h) {
+        for (int ch = 0; ch < c; ++ch) dst[ch] = fill;
+        return;
+    }
+    const size_t stride = static_cast<size_t>(in.w) * c;
+    if (nn) {
+        const T* p = &in.data[static_cast<size_t>(uy) * stride + static_cast<size_t>(ux) * c];
+        for (int ch = 0; ch < c; ++ch) dst[ch] = p[ch];
+        return;
+    }
+    using Acc = typename BilinAcc<T>::type;
+    const int x0 = static_cast<int>(qx >> 16), y0 = static_cast<int>(qy >> 16);
+    const Acc wx = ((qx & 0xFFFF) + 16) >> 5, wy = ((qy & 0xFFFF) + 16) >> 5;
+    const T* r0 = &in.data[static_cast<size_t>(clamp_val(y0, 0, in.h - 1)) * stride];
+    const T* r1 = &in.data[static_cast<size_t>(clamp_val(y0 + 1, 0, in.h - 1)) * stride];
+    const size_t xa = static_cast<size_t>(clamp_val(x0, 0, in.w - 1)) * c, xb = static_cast<size_t>(clamp_val(x0 + 1, 0, in.w - 1)) * c;
+    for (int ch = 0; ch < c; ++ch) {
+        const Acc top = r0[xa + ch] * (kBilinOne - wx) + r0[xb + ch] * wx;
+        const Acc bot = r1[xa + ch] * (kBilinOne - wx) + r1[xb + ch] * wx;
+        dst[ch] = static_cast<T>((top * (kBilinOne - wy) + bot * wy + (Acc(1) << (2 * kBilinBits - 1))) >> (2 * kBilinBits));
+    }
+}
+
+// Interior run of n pixels starting at Q16 position (qx, qy): every tap is in range, no checks.
+template <typename T>
+static void warp_run_scalar(const ImageT<T>& in, WarpInterp mode, int64_t qx, int64_t qy, int64_t dqx, int64_t dqy,
+                            int n, T* dst) {
+    const int c = in.c;
+    const size_t stride = static_cast<size_t>(in.w) * c;
+    const T* src = in.data.data();
+    if (mode == WarpInterp::Nearest) {
+        for (int i = 0; i < n; ++i, qx += dqx, qy += dqy, dst += c) {
+            const T* p = src + static_cast<size_t>(qy >> 16) * stride + static_cast<size_t>(qx >> 16) * c;
+            for (int ch = 0; ch < c; ++ch) dst[ch] = p[ch];
+        }
+        return;
+    }
+    using Acc = typename BilinAcc<T>::type;
+    const Acc round = Acc(1) << (2 * kBilinBits - 1);
+    for (int i = 0; i < n; ++i, qx += dqx, qy += dqy, dst += c) {
+        const Acc wx = ((qx & 0xFFFF) + 16) >> 5, wy = ((qy & 0xFFFF) + 16) >> 5;
+        const T* p0 = src + static_cast<size_t>(qy >> 16) * stride + static_cast<size_t>(qx >> 16) * c;
+        const T* p1 = p0 + stride;
+        for (int ch = 0; ch < c; ++ch) {
+            const Acc top = p0[ch] * (kBilinOne - wx) + p0[ch + c] * wx;
+            const Acc bot = p1[ch] * (kBilinOne - wx) + p1[ch + c] * wx;
+            dst[ch] = static_cast<T>((top * (kBilinOne - wy) + bot * wy + round) >> (2 * kBilinBits));
+        }
+    }
+}
+
+template <typename T>
+static void warp_run(const ImageT<T>& in, WarpInterp mode, int64_t qx, int64_t qy, int64_t dqx, int64_t dqy,
+                     int n, T* dst) {
+    warp_run_scalar(in, mode, qx, qy, dqx, dqy, n, dst);
+}
+
+// 8-bit interior run. AVX2, 8 pixels per step: lane coordinates are the run start plus lane*dq;
+// gathers fetch 32 bits per tap ending at the wanted bytes (nearest c=1: [i-3, i], bilinear c=1:
+// the pair at [i-2, i+1], c=3: [i-1, i+2] per pixel), so nothing past a tap is read. A step whose
+// first index is too close to the buffer start for that offset falls back to the scalar loop.
+// Bilinear uses the Q11 weights of the scalar loop (pmaddwd for the horizontal blend, 32-bit
+// lanes for the vertical one), so both give the same bytes.
+static void warp_run(const Image& in, WarpInterp mode, int64_t qx, int64_t qy, int64_t dqx, int64_t dqy,
+                     int n, uint8_t* dst) {
+    int i = 0;
+    const int c = in.c;
+#if defined(__AVX2__)
+    if (!g_scalar_kernels && (c == 1 || c == 3) && in.data.size() < (size_t(1) << 31)) {
+        const int* src = reinterpret_cast<const int*>(in.data.data());
+        const int stride = in.w * c;
+        const bool nn = mode == WarpInterp::Nearest;
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i stepx = _mm256_mullo_epi32(lane, _mm256_set1_epi32(static_cast<int>(static_cast<uint32_t>(dqx))));
+        const __m256i stepy = _mm256_mullo_epi32(lane, _mm256_set1_epi32(static_cast<int>(static_cast<uint32_t>(dqy))));
+        const __m256i vstride = _mm256_set1_epi32(stride), vc = _mm256_set1_epi32(c);
+        const __m256i fracm = _mm256_set1_epi32(0xFFFF), half = _mm256_set1_epi32(16), one = _mm256_set1_epi32(kBilinOne);
+        const __m256i rnd = _mm256_set1_epi32(1 << (2 * kBilinBits - 1));
+        const __m256i minIdx = _mm256_set1_epi32(c == 3 ? 1 : nn ? 3 : 2);   // gather offset below the tap
+        // byte 3 of each lane (c=1) / bytes 1..3 of each lane (c=3) -> packed output, per 128-bit half
+        const __m256i pack1 = _mm256_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m256i pack3 = _mm256_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+                                               1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+        // bilinear: vertical blend of two Q11 rows -> 8-bit value in the low byte of each lane
+        auto vblend = [&](__m256i top, __m256i bot, __m256i wy) {
+            return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(top, _mm256_sub_epi32(one, wy)),
+                                                                       _mm256_mullo_epi32(bot, wy)), rnd), 2 * kBilinBits);
+        };
+        for (; i + 8 <= n; i += 8) {
+            const __m256i vx = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(qx + i * dqx)), stepx);
+            const __m256i vy = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(qy + i * dqy)), stepy);
+            const __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(vy, 16), vstride),
+                                                 _mm256_mullo_epi32(_mm256_srai_epi32(vx, 16), vc));
+            if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(minIdx, idx))) {
+                warp_run_scalar(in, mode, qx + i * dqx, qy + i * dqy, dqx, dqy, 8, dst + static_cast<size_t>(i) * c);
+                continue;
+            }
+            uint8_t* d = dst + static_cast<size_t>(i) * c;
+            __m256i px;   // one output pixel per lane: c=1 in byte 3, c=3 in bytes 1..3
+            if (nn) {
+                px = _mm256_i32gather_epi32(reinterpret_cast<const int*>(reinterpret_cast<const uint8_t*>(src) - (c == 1 ? 3 : 1)), idx, 1);
+            } else {
+                const __m256i wx = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(vx, fracm), half), 5);
+                const __m256i wy = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(vy, fracm), half), 5);
+                const __m256i w = _mm256_or_si256(_mm256_sub_epi32(one, wx), _mm256_slli_epi32(wx, 16));   // w0 | w1 << 16
+                const __m256i idx1 = _mm256_add_epi32(idx, vstride);
+                if (c == 1) {
+                    const uint8_t* b = reinterpret_cast<const uint8_t*>(src) - 2;
+                    const __m256i pairs = _mm256_setr_epi8(2, -1, 3, -1, 6, -1, 7, -1, 10, -1, 11, -1, 14, -1, 15, -1,
+                                                           2, -1, 3, -1, 6, -1, 7, -1, 10, -1, 11, -1, 14, -1, 15, -1);
+                    const __m256i top = _mm256_madd_epi16(_mm256_shuffle_epi8(_mm256_i32gather_epi32(reinterpret_cast<const int*>(b), idx, 1), pairs), w);
+                    const __m256i bot = _mm256_madd_epi16(_mm256_shuffle_epi8(_mm256_i32gather_epi32(reinterpret_cast<const int*>(b), idx1, 1), pairs), w);
+                    px = _mm256_slli_epi32(vblend(top, bot, wy), 24);
+                } else {
+                    // per row: a = [x r0 g0 b0] (left pixel), b = [b0 r1 g1 b1] (right pixel); channel k
+                    // pairs byte k+1 of a with byte k+1 of b as 16-bit words for pmaddwd
+                    const uint8_t* ba = reinterpret_cast<const uint8_t*>(src) - 1;
+                    const uint8_t* bb = reinterpret_cast<const uint8_t*>(src) + 2;
+                    const __m256i a0 = _mm256_i32gather_epi32(reinterpret_cast<const int*>(ba), idx, 1);
+                    const __m256i b0 = _mm256_i32gather_epi32(reinterpret_cast<const int*>(bb), idx, 1);
+                    const __m256i a1 = _mm256_i32gather_epi32(reinterpret_cast<const int*>(ba), idx1, 1);
+                    const __m256i b1 = _mm256_i32gather_epi32(reinterpret_cast<const int*>(bb), idx1, 1);
+                    px = _mm256_setzero_si256();
+                    for (int k = 0; k < 3; ++k) {
+                        const char s = static_cast<char>(k + 1);
+                        const __m256i ma = _mm256_setr_epi8(s, -1, -1, -1, s + 4, -1, -1, -1, s + 8, -1, -1, -1, s + 12, -1, -1, -1,
+                                                            s, -1, -1, -1, s + 4, -1, -1, -1, s + 8, -1, -1, -1, s + 12, -1, -1, -1);
+                        const __m256i mb = _mm256_setr_epi8(-1, -1, s, -1, -1, -1, s + 4, -1, -1, -1, s + 8, -1, -1, -1, s + 12, -1,
+                                                            -1, -1, s, -1, -1, -1, s + 4, -1, -1, -1, s + 8, -1, -1, -1, s + 12, -1);
+                        const __m256i top = _mm256_madd_epi16(_mm256_or_si256(_mm256_shuffle_epi8(a0, ma), _mm256_shuffle_epi8(b0, mb)), w);
+                        const __m256i bot = _mm256_madd_epi16(_mm256_or_si256(_mm256_shuffle_epi8(a1, ma), _mm256_shuffle_epi8(b1, mb)), w);
+                        px = _mm256_or_si256(px, _mm256_slli_epi32(vblend(top, bot, wy), 8 * (k + 1)));
+                    }
+                }
+            }
+            const __m256i p = _mm256_shuffle_epi8(px, c == 1 ? pack1 : pack3);
+            const __m128i lo = _mm256_castsi256_si128(p), hi = _mm256_extracti128_si256(p, 1);
+            if (c == 1) {
+                const int32_t l = _mm_cvtsi128_si32(lo), h = _mm_cvtsi128_si32(hi);
+                memcpy(d, &l, 4); memcpy(d + 4, &h, 4);
+            } else {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(d), lo);        // 12 bytes + 4 overwritten below
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(d + 12), hi);
+                const int32_t t = _mm_extract_epi32(hi, 2);
+                memcpy(d + 20, &t, 4);
+            }
+        }
+    }
+#endif
+    warp_run_scalar(in, mode, qx + i * dqx, qy + i * dqy, dqx, dqy, n - i, dst + static_cast<size_t>(i) * c);
+}
+
+// warp_block(in, m, mode, y, x0, x1, fill, dst): output row y, columns [x0, x1) (one anchor block,
+// x0 a multiple of kWarpBlock); dst points at column x0.
+template <typename T>
+static void warp_block(const ImageT<T>& in, const WarpMap& m, WarpInterp mode, int y, int x0, int x1, T fill, T* dst) {
+    const int c = in.c;
+    const bool nn = mode == WarpInterp::Nearest;
+    const double px = m.bx * y + m.cx, py = m.by * y + m.cy;
+    // covered: f + 0.5 (nearest: f) in [0, w); interior: every tap in range with kWarpEps to spare
+    const double cov = nn ? 0.0 : -0.5;
+    double c0 = x0, c1 = x1 - 1;
+    warp_clip(m.ax, px, cov, in.w + cov, c0, c1);
+    warp_clip(m.ay, py, cov, in.h + cov, c0, c1);
+    double i0 = c0, i1 = c1;
+    warp_clip(m.ax, px, kWarpEps, (nn ? in.w : in.w - 1) - kWarpEps, i0, i1);
+    warp_clip(m.ay, py, kWarpEps, (nn ? in.h : in.h - 1) - kWarpEps, i0, i1);
+    // outer span one column wider on each side: pixels there are checked, so rounding is harmless
+    int o0 = x1, o1 = x1, f0 = x1, f1 = x1;
+    if (c0 <= c1) {
+        o0 = static_cast<int>(max<double>(x0, floor(c0) - 1));
+        o1 = static_cast<int>(min<double>(x1, ceil(c1) + 2));
+        f0 = f1 = o0;
+        if (i0 <= i1) {
+            f0 = static_cast<int>(clamp_val(ceil(i0), static_cast<double>(o0), static_cast<double>(o1)));
+            f1 = static_cast<int>(clamp_val(floor(i1) + 1, static_cast<double>(f0), static_cast<double>(o1)));
+        }
+    }
+    for (int x = x0; x < o0; ++x) for (int ch = 0; ch < c; ++ch) dst[(x - x0) * c + ch] = fill;
+    for (int x = o1; x < x1; ++x) for (int ch = 0; ch < c; ++ch) dst[(x - x0) * c + ch] = fill;
+    if (o0 >= o1) return;
+    // Q16 anchor at the first covered column; later columns step by dq
+    const int64_t qx = llround((m.ax * o0 + px) * 65536.0), qy = llround((m.ay * o0 + py) * 65536.0);
+    auto q = [&](int x, int64_t q0, int64_t dq) { return q0 + static_cast<int64_t>(x - o0) * dq; };
+    for (int x = o0; x < f0; ++x) warp_px_checked(in, mode, q(x, qx, m.dqx), q(x, qy, m.dqy), fill, dst + (x - x0) * c);
+    if (f1 > f0) warp_run(in, mode, q(f0, qx, m.dqx), q(f0, qy, m.dqy), m.dqx, m.dqy, f1 - f0, dst + (f0 - x0) * c);
+    for (int x = f1; x < o1; ++x) warp_px_checked(in, mode, q(x, qx, m.dqx), q(x, qy, m.dqy), fill, dst + (x - x0) * c);
+}
+
+template <typename T>
+static ImageT<T> warp_affine(const ImageT<T>& in, const Affine& fwd, int outW, int outH, WarpInterp mode, T fill) {
+    if (in.empty() || outW < 1 || outH < 1) return ImageT<T>{};
+    if (in.w > 32767 || in.h > 32767) {
+        cerr << "warp: source larger than 32767x32767\n";
+        return ImageT<T>{};
+    }
+    Affine inv;
+    if (!affine_invert(fwd, inv)) {
+        cerr << "warp: matrix is singular\n";
+        return ImageT<T>{};
+    }
+    // inv maps continuous output coordinates to source ones; evaluate at pixel centres (x+0.5)
+    // and shift to sample positions (-0.5), or to floor-able positions for nearest (+0)
+    const double sh = mode == WarpInterp::Nearest ? 0.0 : -0.5;
+    WarpMap m;
+    m.ax = inv.a; m.bx = inv.b; m.cx = 0.5 * (inv.a + inv.b) + inv.c + sh;
+    m.ay = inv.d; m.by = inv.e; m.cy = 0.5 * (inv.d + inv.e) + inv.f + sh;
+    if (fabs(m.ax) > 32768 || fabs(m.ay) > 32768) {
+        cerr << "warp: matrix shrinks the image more than 32768x\n";
+        return ImageT<T>{};
+    }
+    m.dqx = llround(m.ax * 65536.0);
+    m.dqy = llround(m.ay * 65536.0);
+
+    ImageT<T> out;
+    out.w = outW; out.h = outH; out.c = in.c;
+    out.data.resize(static_cast<size_t>(outW) * outH * in.c);
+    const size_t rowN = static_cast<size_t>(outW) * in.c;
+    parallel_tiles(outW, outH, kWarpTileW, kWarpTileH, [&](int x0, int x1, int y0, int y1) {
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; x += kWarpBlock)
+                warp_block(in, m, mode, y, x, min(x1, x + kWarpBlock), fill, &out.data[rowN * y + static_cast<size_t>(x) * in.c]);
+    });
+    return out;
+}
+
+// --------------------- Colormaps ---------------------
+// 256-entry RGB tables for false-color display, index = gray level.
+// Entries are packed as 4 bytes {r, g, b, 0} (one uint32 per entry, byte order fixed by memcpy),
+// so expanding a gray row is one 32-bit load per pixel plus a 3-of-4 byte store.
+//   hot:     black -> red -> yellow -> white (red ramps over the first 3/8, green the next 3/8, blue the last 1/4)
+//   jet:     blue -> cyan -> yellow -> red (piecewise-linear, 1.5 - |4t - k| per channel)
+//   bone:    (7*gray + hot with R/B swapped) / 8 — blue-tinted gray
+//   viridis: perceptually uniform; degree-6 polynomial fit per channel (within a few levels of the reference table)
+//   @file:   user table, 2..256 lines of "r g b" (0..255, '#' comments), resampled linearly to 256
+struct Colormap {
+    uint32_t rgbx[256];
+    const uint8_t* rgb(int i) const { return reinterpret_cast<const uint8_t*>(&rgbx[i]); }
+    void set(int i, uint8_t r, uint8_t g, uint8_t b) {
+        const uint8_t px[4] = { r, g, b, 0 };
+        memcpy(&rgbx[i], px, 4);
+    }
+};
+
+static bool builtin_colormap(const string& name, Colormap& cm) {
+    auto unit = [](double v) { return static_cast<uint8_t>(lround(255.0 * clamp_val(v, 0.0, 1.0))); };
+    // viridis coefficients, c0..c6 (lowest order first), one row per channel
+    static const double vir[3][7] = {
+        { 0.2777273272234177,  0.1050930431085774, -0.3308618287255563,  -4.634230498983486,
+          6.228269936347081,   4.776384997670288,  -5.435455855934631 },
+        { 0.005407344544966578, 1.404613529898575,  0.214847559468213,   -5.799100973351585,
+          14.17993336680509,  -13.74514537774601,   4.645852612178535 },
+        { 0.3340998053353061,  1.384590162594685,   0.09509516302823659, -19.33244095627987,
+          56.69055260068105,  -65.35303263337234,  26.3124352495832 } };
+    const string n = to_lower(name);
+    if (n != "hot" && n != "jet" && n != "bone" && n != "viridis") {
+        cerr << "Unknown colormap: " << name << " (hot|jet|bone|viridis|@file)\n";
+        return false;
+    }
+    for (int i = 0; i < 256; ++i) {
+        const double t = i / 255.0;
+        double rgb[3];
+        if (n == "hot" || n == "bone") {
+            const uint8_t h[3] = { unit(t / 0.375), unit((t - 0.375) / 0.375), unit((t - 0.75) / 0.25) };
+            if (n == "hot") { cm.set(i, h[0], h[1], h[2]); continue; }
+            // integer mix keeps the table identical whether or not the compiler contracts to FMA
+            cm.set(i, static_cast<uint8_t>((7 * i + h[2] + 4) >> 3), static_cast<uint8_t>((7 * i + h[1] + 4) >> 3),
+                   static_cast<uint8_t>((7 * i + h[0] + 4) >> 3));
+            continue;
+        } else if (n == "jet") {
+            for (int k = 0; k < 3; ++k) rgb[k] = 1.5 - fabs(4.0 * t - (3 - k));
+        } else {
+            for (int k = 0; k < 3; ++k) {
+                double v = vir[k][6];
+                for (int d = 5; d >= 0; --d) v = v * t + vir[k][d];
+                rgb[k] = v;
+            }
+        }
+        cm.set(i, unit(rgb[0]), unit(rgb[1]), unit(rgb[2]));
+    }
+    return true;
+}
+
+// load_colormap(spec, cm): builtin name, or "@path" for a user table.
+static bool load_colormap(const string& spec, Colormap& cm) {
+    if (spec.empty() || spec[0] != '@') return builtin_colormap(spec, cm);
+    const string path = spec.substr(1);
+    ifstream in(path);
+    if (!in) { cerr << "Cannot open colormap " << path << "\n"; return false; }
+    vector<int> v;
+    string line;
+    while (getline(in, line)) {
+        const size_t hash = line.find('#');
+        if (hash != string::npos) line.erase(hash);
+        istringstream ss(line);
+        int r, g, b;
+        if (!(ss >> r)) continue;   // blank / comment line
+        if (!(ss >> g >> b) || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+            cerr << "Bad colormap line in " << path << ": " << line << "\n";
+            return false;
+        }
+        v.push_back(r); v.push_back(g); v.push_back(b);
+    }
+    const int n = static_cast<int>(v.size() / 3);
+    if (n < 2 || n > 256) { cerr << "Colormap " << path << " needs 2..256 entries, got " << n << "\n"; return false; }
+    for (int i = 0; i < 256; ++i) {
+        const double f = i * (n - 1) / 255.0;
+        const int j = min(static_cast<int>(f), n - 2);
+        const double w = f - j;
+        uint8_t c[3];
+        for (int k = 0; k < 3; ++k)
+            c[k] = static_cast<uint8_t>(lround(v[3*j + k] * (1.0 - w) + v[3*(j+1) + k] * w));
+        cm.set(i, c[0], c[1], c[2]);
+    }
+    return true;
+}
+
+// colormap_row(src, dst, n, cm): n gray samples -> 3n interleaved RGB bytes.
+// SSSE3: 4 table entries per register, pshufb drops every 4th byte (12 useful bytes), and the
+// 16-byte stores overlap by 4 so the next store overwrites the junk. Scalar: the same overlapping
+// trick with 4-byte stores. Both stop early enough that no write lands past dst[3n-1].
+static void colormap_row(const uint8_t* src, uint8_t* dst, size_t n, const Colormap& cm) {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const uint32_t* t = cm.rgbx;
+    // last store of a block covers bytes [3i+36, 3i+52): needs 3i+52 <= 3n
+    for (; i + 18 <= n; i += 16) {
+        const uint8_t* s = src + i;
+        uint8_t* d = dst + 3 * i;
+        for (int q = 0; q < 4; ++q, s += 4, d += 12) {
+            const __m128i v = _mm_setr_epi32(static_cast<int>(t[s[0]]), static_cast<int>(t[s[1]]),
+                                             static_cast<int>(t[s[2]]), static_cast<int>(t[s[3]]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_shuffle_epi8(v, pack));
+        }
+    }
+#endif
+    for (; i + 2 <= n; ++i) memcpy(dst + 3 * i, &cm.rgbx[src[i]], 4);
+    for (; i < n; ++i) memcpy(dst + 3 * i, &cm.rgbx[src[i]], 3);
+}
+
+// op_colormap(in, cm): gray (RGB inputs are reduced to luma first) -> 3-channel false color.
+static Image op_colormap(const Image& in, const Colormap& cm) {
+    if (in.empty()) return Image{};
+    Image out; out.w = in.w; out.h = in.h; out.c = 3;
+    out.data.resize(static_cast<size_t>(in.w) * in.h * 3);
+    parallel_rows(in.h, [&](int y0, int y1) {
+        vector<uint8_t> luma(in.c == 3 ? in.w : 0);
+        for (int y = y0; y < y1; ++y) {
+            const uint8_t* sp = &in.data[static_cast<size_t>(y) * in.w * in.c];
+            if (in.c == 3) {
+                for (int x = 0; x < in.w; ++x, sp += 3) luma[x] = static_cast<uint8_t>(luma_u8(sp[0], sp[1], sp[2]));
+                sp = luma.data();
+            }
+            colormap_row(sp, &out.data[static_cast<size_t>(y) * in.w * 3], static_cast<size_t>(in.w), cm);
+        }
+    });
+    return out;
+}
+
+// --------------------- Overlay (false-color fusion) ---------------------
+// op_overlay(base, map, cm, alpha, thr):
+// Colors the single-channel map through cm (colormap_row) and alpha-blends it onto base (gray
+// bases are promoted to RGB; other channel counts are rejected). Pixels with map < thr keep the base value, so only the "hot" region is tinted.
+// The blend is 8.8 fixed point with a per-byte weight (0 or alpha*256):
+//   out = (base*(256-w) + color*w + 128) >> 8
+// Both images must already have the same size (the CLI resizes them on the fly).
+static void blend_row_weighted(const uint8_t* a, const uint8_t* b, const uint8_t* w8, uint8_t* d, size_t n,
+                               int alpha) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // w8 holds 0 / 1 per byte; 16-bit weights are built as mask & alpha
+    const __m128i zero = _mm_setzero_si128(), r128 = _mm_set1_epi16(128), v256 = _mm_set1_epi16(256);
+    const __m128i va16 = _mm_set1_epi16(static_cast<short>(alpha));
+    for (; i + 16 <= n; i += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i m  = _mm_cmpgt_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w8 + i)), zero);
+        const __m128i wlo = _mm_and_si128(_mm_unpacklo_epi8(m, m), va16);
+        const __m128i whi = _mm_and_si128(_mm_unpackhi_epi8(m, m), va16);
+        const __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), _mm_sub_epi16(v256, wlo)),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wlo)), r128), 8);
+        const __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), _mm_sub_epi16(v256, whi)),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), whi)), r128), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; ++i) {
+        const int w = w8[i] ? alpha : 0;
+        d[i] = static_cast<uint8_t>((a[i] * (256 - w) + b[i] * w + 128) >> 8);
+    }
+}
+
+static Image op_overlay(const Image& base, const Image& map, const Colormap& cm, float alpha, int thr) {
+    if (base.empty() || map.empty()) return Image{};
+    if (map.c != 1) { cerr << "overlay: map must be single-channel (c=1)\n"; return Image{}; }
+    if (base.c != 1 && base.c != 3) { cerr << "overlay: base must be gray or RGB (c=1 or 3)\n"; return Image{}; }
+    if (base.w != map.w || base.h != map.h) {
+        cerr << "overlay: size mismatch (" << base.w << "x" << base.h << " vs " << map.w << "x" << map.h << ")\n";
+        return Image{};
+    }
+    const int a = static_cast<int>(lround(clamp_val(alpha, 0.0f, 1.0f) * 256.0f));
+    const int W = base.w;
+    Image out; out.w = W; out.h = base.h; out.c = 3;
+    out.data.resize(static_cast<size_t>(W) * base.h * 3);
+
+    parallel_rows(base.h, [&](int y0, int y1) {
+        vector<uint8_t> b3(static_cast<size_t>(W) * 3), col(static_cast<size_t>(W) * 3), w8(static_cast<size_t>(W) * 3);
+        for (int y = y0; y < y1; ++y) {
+            const uint8_t* bp = &base.data[static_cast<size_t>(y) * W * base.c];
+            const uint8_t* mp = &map.data[static_cast<size_t>(y) * W];
+            const uint8_t* src = bp;
+            if (base.c == 1) {
+                for (int x = 0; x < W; ++x) b3[3*x] = b3[3*x+1] = b3[3*x+2] = bp[x];
+                src = b3.data();
+            }
+            colormap_row(mp, col.data(), W, cm);
+            for (int x = 0; x < W; ++x) w8[3*x] = w8[3*x+1] = w8[3*x+2] = (mp[x] >= thr);
+            blend_row_weighted(src, col.data(), w8.data(), &out.data[static_cast<size_t>(y) * W * 3],
+                               static_cast<size_t>(W) * 3, a);
+        }
+    });
+    return out;
+}
+
+// --------------------- PNM (PGM/PPM) ---------------------
+// read_pnm_header(in, w, h, c, maxval):
+// Binary P5 (gray) / P6 (RGB) only; '#' comments allowed between fields.
+// Leaves the stream at the first sample. maxval > 255 means 2 bytes/sample, big-endian.
+static bool read_pnm_header(istream& in, int& w, int& h, int& c, int& maxval) {
+    char p = 0, t = 0;
+    in.get(p); in.get(t);
+    if (p != 'P' || (t != '5' && t != '6')) return false;
+    c = (t == '5') ? 1 : 3;
+    int* fields[3] = { &w, &h, &maxval };
+    for (int i = 0; i < 3; ++i) {
+        in >> ws;
+        while (in.peek() == '#') { string skip; getline(in, skip); in >> ws; }
+        if (!(in >> *fields[i])) return false;
+    }
+    in.get();   // single whitespace byte before the raster
+    return in && w > 0 && h > 0 && maxval > 0 && maxval <= 65535;
+}
+
+// pnm_maxval(path): maxval from the header, or -1 if the file is not a readable P5/P6.
+static int pnm_maxval(const string& path) {
+    ifstream in(path, ios::binary);
+    int w = 0, h = 0, c = 0, maxval = 0;
+    if (!in || !read_pnm_header(in, w, h, c, maxval)) return -1;
+    return maxval;
+}
+
+// load_pnm(path): 8-bit P5/P6 (maxval <= 255). 16-bit files go through load_pnm16().
+static Image load_pnm(const string& path) {
+    Image img;
+    ifstream in(path, ios::binary);
+    if (!in) { cerr << "Cannot open PNM " << path << "\n"; return img; }
+    int maxval = 0;
+    if (!read_pnm_header(in, img.w, img.h, img.c, maxval)) { cerr << "Not a P5/P6 PNM: " << path << "\n"; return Image{}; }
+    if (maxval > 255) { cerr << "16-bit PNM (maxval=" << maxval << ") not supported by this command\n"; return Image{}; }
+    img.data.resize(static_cast<size_t>(img.w) * img.h * img.c);
+    in.read(reinterpret_cast<char*>(img.data.data()), (streamsize)img.data.size());
+    if (!in) { cerr << "PNM truncated\n"; return Image{}; }
+    return img;
+}
+
+// load_pnm16(path): any P5/P6; samples keep their file values (8-bit files are widened as-is).
+static Image16 load_pnm16(const string& path) {
+    Image16 img;
+    ifstream in(path, ios::binary);
+    if (!in) { cerr << "Cannot open PNM " << path << "\n"; return img; }
+    int maxval = 0;
+    if (!read_pnm_header(in, img.w, img.h, img.c, maxval)) { cerr << "Not a P5/P6 PNM: " << path << "\n"; return Image16{}; }
+    const size_t n = static_cast<size_t>(img.w) * img.h * img.c;
+    const size_t bytesPer = maxval > 255 ? 2 : 1;
+    vector<unsigned char> raw(n * bytesPer);
+    in.read(reinterpret_cast<char*>(raw.data()), (streamsize)raw.size());
+    if (!in) { cerr << "PNM truncated\n"; return Image16{}; }
+    img.data.resize(n);
+    if (bytesPer == 2) {
+        for (size_t i = 0; i < n; ++i) img.data[i] = static_cast<uint16_t>((raw[2*i] << 8) | raw[2*i + 1]);
+    } else {
+        for (size_t i = 0; i < n; ++i) img.data[i] = raw[i];
+    }
+    return img;
+}
+
+// write_pnm16(path, img): 16-bit P5/P6, maxval 65535, big-endian samples.
+static bool write_pnm16(const string& path, const Image16& img) {
+    if (img.empty()) return false;
+    ofstream out(path, ios::binary);
+    if (!out) { cerr << "Cannot write " << path << "\n"; return false; }
+    out << (img.c == 1 ? "P5\n" : "P6\n")
+        << img.w << " " << img.h << "\n"
+        << 65535 << "\n";
+    vector<unsigned char> raw(img.data.size() * 2);
+    for (size_t i = 0; i < img.data.size(); ++i) {
+        raw[2*i]     = static_cast<unsigned char>(img.data[i] >> 8);
+        raw[2*i + 1] = static_cast<unsigned char>(img.data[i] & 0xFF);
+    }
+    out.write(reinterpret_cast<const char*>(raw.data()), (streamsize)raw.size());
+    return static_cast<bool>(out);
+}
+
+static bool write_pnm(const string& path, const Image& img) {
+    if (img.empty()) return false;
+    const bool isGray = (img.c == 1);
+    ofstream out(path, ios::binary);
+    if (!out) { cerr << "Cannot write " << path << "\n"; return false; }
+    out << (isGray ? "P5\n" : "P6\n")
+        << img.w << " " << img.h << "\n"
+        << 255 << "\n";
+    out.write(reinterpret_cast<const char*>(img.data.data()), img.data.size());
+    return static_cast<bool>(out);
+}
+// ------- BMP writer (BI_RGB; 24-bit for RGB, 8-bit paletted for gray) -------
+// write_bmp_header(out, W, H, isGray): file + info headers and the gray palette; returns the
+// pixel array offset. Shared by write_bmp() and RowWriter.
+static uint32_t write_bmp_header(ostream& out, int W, int H, bool isGray) {
+    const int bpp = isGray ? 8 : 24;
+    const int rowSize = bmp_row_size_bytes(bpp, W);
+    const int pixelArraySize = rowSize * H;
+
+    // Headers
+    const uint32_t bfOffBits = 14 + 40 + (isGray ? 256 * 4 : 0); // file + DIB + palette
+    const uint32_t bfSize    = bfOffBits + pixelArraySize;
+
+    auto wr_u16 = [&](uint16_t v){ out.put((char)(v & 0xFF)); out.put((char)(v >> 8)); };
+    auto wr_u32 = [&](uint32_t v){
+        out.put((char)( v        & 0xFF));
+        out.put((char)((v >> 8 ) & 0xFF));
+        out.put((char)((v >> 16) & 0xFF));
+        out.put((char)((v >> 24) & 0xFF));
+    };
+    auto wr_s32 = [&](int32_t v){ wr_u32((uint32_t)v); };
+
+    // BITMAPFILEHEADER (14)
+    out.put('B'); out.put('M');
+    wr_u32(bfSize);
+    wr_u16(0); wr_u16(0);     // reserved
+    wr_u32(bfOffBits);
+
+    // BITMAPINFOHEADER (40)
+    wr_u32(40);               // biSize
+    wr_s32(W);
+    wr_s32(H);                // positive -> bottom-up
+    wr_u16(1);                // planes
+    wr_u16((uint16_t)bpp);
+    wr_u32(0);                // BI_RGB
+    wr_u32(pixelArraySize);
+    wr_s32(2835);             // ~72 DPI (optional)
+    wr_s32(2835);
+    wr_u32(isGray ? 256u : 0u); // colors used
+    wr_u32(0);
+
+    // Palette for 8-bit (grayscale ramp, BGRA)
+    if (isGray) {
+        for (int i = 0; i < 256; ++i) {
+            unsigned char b = (unsigned char)i;
+            out.put((char)b); out.put((char)b); out.put((char)b); out.put((char)0);
+        }
+    }
+    return bfOffBits;
+}
+
+// bmp_pack_row(src, W, isGray, row): one image row in file order (RGB -> BGR; gray is the index)
+static void bmp_pack_row(const unsigned char* src, int W, bool isGray, unsigned char* row) {
+    if (isGray) {
+        // indices directly from grayscale
+        std::memcpy(row, src, (size_t)W);
+    } else {
+        // convert RGB -> BGR in file
+        for (int x = 0; x < W; ++x) {
+            row[x*3 + 0] = src[x*3 + 2]; // B
+            row[x*3 + 1] = src[x*3 + 1]; // G
+            row[x*3 + 2] = src[x*3 + 0]; // R
+        }
+    }
+}
+
+static bool write_bmp(const std::string& path, const Image& img) {
+    if (img.empty()) return false;
+
+    const int W = img.w, H = img.h;
+    const bool isGray = (img.c == 1);
+    const int rowSize = bmp_row_size_bytes(isGray ? 8 : 24, W);
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) { std::cerr << "Cannot write " << path << "\n"; return false; }
+    write_bmp_header(out, W, H, isGray);
+
+    // Pixel data (bottom-up)
+    std::vector<unsigned char> row(rowSize, 0);
+    for (int y = H - 1; y >= 0; --y) {           // write bottom row first
+        bmp_pack_row(&img.data[(size_t)y * W * img.c], W, isGray, row.data());
+        out.write((const char*)row.data(), rowSize);
+        if (!out) { std::cerr << "BMP write row failed\n"; return false; }
+    }
+    return true;
+}
+
+// load_by_extension(path):
+//   .bmp      -> load_bmp()
+//   .raw      -> load_raw_grayscale(512,512)
+//   .pgm/.ppm -> load_pnm() (8-bit)
+//   .jpg/.png -> not supported in stdlib build (print conversion hint)
 static Image load_by_extension(const string& path) {
     const string ext = file_ext(path);
     if (ext == ".bmp") {
-        return load_bmp(path);
+        return load_bmp(path, g_load_gray);
+    } else if (ext == ".pgm" || ext == ".ppm" || ext == ".pnm") {
+        Image im = load_pnm(path);
+        return g_load_gray ? op_gray(im, g_luma_weights) : im;
     } else if (ext == ".raw") {
         return load_raw_grayscale(path, 512, 512);
     } else if (ext == ".jpg" || ext == ".jpeg" || ext == ".png") {
@@ -465,6 +3660,28 @@ static Image load_by_extension(const string& path) {
     }
 }
 
+// is_pnm16(path): true for a .pgm/.ppm/.pnm whose maxval needs 2 bytes per sample
+static bool is_pnm16(const string& path) {
+    const string ext = file_ext(path);
+    return (ext == ".pgm" || ext == ".ppm" || ext == ".pnm") && pnm_maxval(path) > 255;
+}
+
+// load_by_extension16(path): 16-bit counterpart of load_by_extension() (PGM/PPM only, honors --gray)
+static Image16 load_by_extension16(const string& path) {
+    Image16 im = load_pnm16(path);
+    return g_load_gray ? op_gray(im, g_luma_weights) : im;
+}
+
+// write_by_extension16(path, img): 16-bit output exists only as PGM/PPM
+static bool write_by_extension16(const string& path, const Image16& img) {
+    const string ext = file_ext(path);
+    if (ext != ".pgm" && ext != ".ppm" && ext != ".pnm") {
+        cerr << "16-bit output needs a .pgm/.ppm file (got '" << ext << "')\n";
+        return false;
+    }
+    return write_pnm16(path, img);
+}
+
 static bool write_by_extension(const std::string& path, const Image& img) {
     const std::string ext = file_ext(path);
     if (ext == ".pgm" || ext == ".ppm") {
@@ -479,21 +3696,488 @@ static bool write_by_extension(const std::string& path, const Image& img) {
     }
 }
 
+// --------------------- Row streaming I/O ---------------------
+// RowReader: an 8-bit BMP / PGM / PPM / RAW read top to bottom, one row per read_row() call,
+// without holding the image (BMP rows decode through BmpRows; --gray is honored like the loaders).
+struct RowReader {
+    int w = 0, h = 0, c = 0;
+    int next = 0;                   // next row read_row() returns
+    ifstream in;
+    bool bmp = false;
+    BmpRows b;
+    bool toGray = false;            // PPM with --gray: convert each row
+    vector<uint8_t> raw;
+};
+
+static bool open_row_reader(const string& path, RowReader& r) {
+    const string ext = file_ext(path);
+    r.in.open(path, ios::binary);
+    if (!r.in) { cerr << "Cannot open " << path << "\n"; return false; }
+    if (ext == ".bmp") {
+        if (!open_bmp_rows(r.in, path, g_load_gray, r.b)) return false;
+        r.bmp = true; r.w = r.b.w; r.h = r.b.h; r.c = r.b.c;
+    } else if (ext == ".pgm" || ext == ".ppm" || ext == ".pnm") {
+        int maxval = 0;
+        if (!read_pnm_header(r.in, r.w, r.h, r.c, maxval)) { cerr << "Not a P5/P6 PNM: " << path << "\n"; return false; }
+        if (maxval > 255) { cerr << "16-bit PNM (maxval=" << maxval << ") not supported by this command\n"; return false; }
+        if (g_load_gray && r.c == 3) { r.toGray = true; r.raw.resize(static_cast<size_t>(r.w) * 3); r.c = 1; }
+    } else if (ext == ".raw") {
+        r.w = 512; r.h = 512; r.c = 1;
+    } else {
+        cerr << "Unknown extension: " << ext << "\n";
+        return false;
+    }
+    return true;
+}
+
+// read_row(r, dst): next row into dst (w*c bytes); false at the end or on a short file
+static bool read_row(RowReader& r, uint8_t* dst) {
+    if (r.next >= r.h) return false;
+    const int y = r.next++;
+    if (r.bmp) {
+        if (read_bmp_row(r.in, r.b, y, dst)) return true;
+        cerr << "BMP truncated row\n"; return false;
+    }
+    if (r.toGray) {
+        r.in.read(reinterpret_cast<char*>(r.raw.data()), (streamsize)r.raw.size());
+        gray_row(r.raw.data(), dst, static_cast<size_t>(r.w), kLumaW[static_cast<int>(g_luma_weights)]);
+    } else {
+        r.in.read(reinterpret_cast<char*>(dst), (streamsize)r.w * r.c);
+    }
+    if (!r.in) { cerr << "File truncated at row " << y << "\n"; return false; }
+    return true;
+}
+
+// RowWriter: output written one row at a time, top to bottom, same bytes as write_by_extension().
+// BMP keeps its bottom-up layout: the header fixes the file size, so each row is written straight
+// to its slot (seekp) as it arrives.
+struct RowWriter {
+    int w = 0, h = 0, c = 0;
+    int next = 0;
+    ofstream out;
+    bool bmp = false;
+    streamoff offBits = 0;
+    int rowBytes = 0;
+    vector<unsigned char> row;
+};
+
+static bool open_row_writer(const string& path, int w, int h, int c, RowWriter& wr) {
+    const string ext = file_ext(path);
+    wr.w = w; wr.h = h; wr.c = c;
+    wr.out.open(path, ios::binary);
+    if (!wr.out) { cerr << "Cannot write " << path << "\n"; return false; }
+    if (ext == ".bmp") {
+        wr.bmp = true;
+        wr.offBits = write_bmp_header(wr.out, w, h, c == 1);
+        wr.rowBytes = bmp_row_size_bytes(c == 1 ? 8 : 24, w);
+        wr.row.assign(wr.rowBytes, 0);
+    } else {
+        if (ext != ".pgm" && ext != ".ppm")
+            cerr << "Unknown output extension '" << ext << "'. Writing PNM instead.\n";
+        wr.out << (c == 1 ? "P5\n" : "P6\n") << w << " " << h << "\n" << 255 << "\n";
+    }
+    return static_cast<bool>(wr.out);
+}
+
+static bool write_row(RowWriter& wr, const uint8_t* src) {
+    if (wr.next >= wr.h) return false;
+    const int y = wr.next++;
+    if (wr.bmp) {
+        bmp_pack_row(src, wr.w, wr.c == 1, wr.row.data());
+        wr.out.seekp(wr.offBits + static_cast<streamoff>(wr.rowBytes) * (wr.h - 1 - y), ios::beg);
+        wr.out.write(reinterpret_cast<const char*>(wr.row.data()), wr.rowBytes);
+    } else {
+        wr.out.write(reinterpret_cast<const char*>(src), static_cast<streamsize>(wr.w) * wr.c);
+    }
+    return static_cast<bool>(wr.out);
+}
+
+// --------------------- Streaming resize ---------------------
+// StreamResize: nearest / bilinear / area restructured to consume source rows one at a time, in
+// order. stream_resize_push(s, j, row, wr) takes source row j and writes every output row whose
+// last source row is j, so nothing but O(width) state is kept between rows:
+//   nearest:  nothing (output rows are made from the row just pushed, repeats re-write it)
+//   bilinear: horizontal-pass rows of the last two source rows (ring of 2, slot = row & 1);
+//             rows no output row reads are skipped
+//   area:     the running vertical sum of the current output row
+// Same tables and row kernels as resize_nearest / resize_bilinear / resize_area (general paths;
+// the 2x/4x bilinear shortcuts produce the same bytes), so the output is identical.
+enum class StreamMode { Nearest, Bilinear, Area };
+
+struct StreamResize {
+    StreamMode mode = StreamMode::Bilinear;
+    int srcW = 0, c = 0, w = 0, h = 0;
+    int y = 0;                      // next output row
+    NearestX nx;
+    vector<int> yidx;
+    BilinX bx;
+    vector<BilinTap> yt;
+    vector<uint32_t> hrow[2];
+    AreaTaps ax, ay;
+    int k = 0;                      // area: taps of row y already in vsum
+    vector<uint32_t> vsum;
+    vector<uint8_t> out;            // current output row
+};
+
+static void stream_resize_init(StreamResize& s, StreamMode mode, int srcW, int srcH, int c, int newW, int newH) {
+    s.mode = mode; s.srcW = srcW; s.c = c; s.w = newW; s.h = newH; s.y = 0; s.k = 0;
+    const size_t rowN = static_cast<size_t>(newW) * c;
+    s.out.assign(rowN, 0);
+    if (mode == StreamMode::Nearest) {
+        s.nx = nearest_x(srcW, newW, c);
+        s.yidx = nearest_index(srcH, newH);
+    } else if (mode == StreamMode::Bilinear) {
+        s.bx = bilinear_x(srcW, newW, c);
+        s.yt = bilinear_taps(srcH, newH, 1);
+        s.hrow[0].assign(rowN, 0); s.hrow[1].assign(rowN, 0);
+    } else {
+        s.ax = area_taps(srcW, newW, c);
+        s.ay = area_taps(srcH, newH, 1);
+        s.vsum.assign(static_cast<size_t>(srcW) * c, 0);
+    }
+}
+
+static bool stream_resize_push(StreamResize& s, int j, const uint8_t* row, RowWriter& wr) {
+    const size_t rowN = static_cast<size_t>(s.w) * s.c;
+    if (s.mode == StreamMode::Nearest) {
+        for (; s.y < s.h && s.yidx[s.y] == j; ++s.y) {
+            if (s.y == 0 || s.yidx[s.y - 1] != j) nearest_row(row, s.nx.xofs, s.nx.runs, s.c, s.out.data());
+            if (!write_row(wr, s.out.data())) return false;
+        }
+    } else if (s.mode == StreamMode::Bilinear) {
+        if (s.y < s.h && j >= s.yt[s.y].o0) bilinear_hrow(row, s.bx, s.c, s.hrow[j & 1].data());
+        for (; s.y < s.h && s.yt[s.y].o1 <= j; ++s.y) {
+            const BilinTap& t = s.yt[s.y];
+            bilinear_vrow(s.hrow[t.o0 & 1].data(), s.hrow[t.o1 & 1].data(), static_cast<uint32_t>(t.w), s.out.data(), rowN);
+            if (!write_row(wr, s.out.data())) return false;
+        }
+    } else {
+        const size_t srcRow = static_cast<size_t>(s.srcW) * s.c;
+        while (s.y < s.h) {
+            const int t = s.ay.start[s.y] + s.k;
+            if (s.k >= s.ay.count[s.y] || s.ay.idx[t] != j) break;
+            area_vaccum(s.vsum.data(), row, s.ay.w[t], srcRow, s.k == 0);
+            if (++s.k < s.ay.count[s.y]) break;
+            area_hrow(s.vsum.data(), s.ax, s.c, s.out.data());
+            if (!write_row(wr, s.out.data())) return false;
+            ++s.y; s.k = 0;
+        }
+    }
+    return true;
+}
+
+// ResizeTarget: one rendition of a (multi-target) resize
+struct ResizeTarget { int w, h; string path; };
+
+// resize_stream(inpath, targets, mode): file to file for every target in one read of the input.
+// Source rows are read once, in blocks of kStreamBlock, and each block is pushed to all targets
+// (one pool task per target, each with its own StreamResize and RowWriter), so memory is the
+// block plus O(width) per target. Returns false (message printed) on I/O errors.
+static constexpr int kStreamBlock = 16;
+
+static bool resize_stream(const string& inpath, const vector<ResizeTarget>& targets, StreamMode mode) {
+    RowReader rd;
+    if (!open_row_reader(inpath, rd)) return false;
+    const int n = static_cast<int>(targets.size());
+    vector<RowWriter> wr(n);
+    vector<StreamResize> s(n);
+    for (int t = 0; t < n; ++t) {
+        if (!open_row_writer(targets[t].path, targets[t].w, targets[t].h, rd.c, wr[t])) return false;
+        stream_resize_init(s[t], mode, rd.w, rd.h, rd.c, targets[t].w, targets[t].h);
+    }
+    const size_t rowBytes = static_cast<size_t>(rd.w) * rd.c;
+    vector<uint8_t> block(rowBytes * kStreamBlock);
+    vector<char> ok(n, 1);
+    for (int j0 = 0; j0 < rd.h; j0 += kStreamBlock) {
+        const int nb = min(kStreamBlock, rd.h - j0);
+        for (int r = 0; r < nb; ++r)
+            if (!read_row(rd, &block[rowBytes * r])) return false;
+        ThreadPool::get().run(n, [&](int t) {
+            for (int r = 0; r < nb && ok[t]; ++r) ok[t] = stream_resize_push(s[t], j0 + r, &block[rowBytes * r], wr[t]);
+        });
+        for (int t = 0; t < n; ++t)
+            if (!ok[t]) { cerr << "Write failed: " << targets[t].path << "\n"; return false; }
+    }
+    for (int t = 0; t < n; ++t)
+        if (s[t].y != targets[t].h) { cerr << "Stream ended before the last output row\n"; return false; }
+    return true;
+}
+
+// --------------------- Self test ---------------------
+// run_selftest(): reproducible checks of documented accuracy bounds (main selftest). Prints one
+// line per check, "ok" or "FAIL", and returns false if any check fails.
+//   fast math: fast_log2 / fast_exp2 / fast_pow and their SSE2 versions against double-precision
+//              std::log2 / std::exp2 / std::pow, swept over the ranges documented in Fast math
+//   16-bit:    op_gamma_hd / op_log_hd on every 16-bit value against the rounded std::pow / std::log2
+//              reference, at most 1 LSB apart
+//   warp:      warp_affine against a double-precision evaluation of its definition, including
+//              one-pixel-wide / -tall sources (nearest exact; bilinear within 1 at 8 bits, within
+//              one Q11 weight step, 65535/2048, at 16 bits)
+struct SelfTest {
+    bool ok = true;
+    void check(const string& name, double err, double limit) {
+        const bool pass = err <= limit;   // NaN fails
+        ok = ok && pass;
+        ostringstream line;
+        line << "  " << left << setw(52) << name << " max err " << setw(12) << err
+             << " limit " << setw(8) << limit << (pass ? " ok" : " FAIL") << "\n";
+        cout << line.str();
+    }
+};
+
+// selftest_eval(fs, fv, x, n, out, vec): out = f(x) for n inputs through the scalar or (vec) SSE2 path
+template <typename FS, typename FV>
+static void selftest_eval(FS fs, FV fv, const float* x, size_t n, float* out, bool vec) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (vec) for (; i + 4 <= n; i += 4) _mm_storeu_ps(out + i, fv(_mm_loadu_ps(x + i)));
+#else
+    (void)fv; (void)vec;
+#endif
+    for (; i < n; ++i) out[i] = fs(x[i]);
+}
+
+static void selftest_fast_math(SelfTest& t) {
+    const int kN = 1 << 20;
+    vector<float> x(kN), r(kN);
+    for (int pass = 0; pass < 2; ++pass) {
+        const bool vec = pass == 1;
+#if !defined(__SSE2__)
+        if (vec) break;
+#endif
+        const string tag = vec ? " (SSE2)" : "";
+        // log2 over [2^-16, 1]: absolute error
+        for (int i = 0; i < kN; ++i) x[i] = static_cast<float>(exp2(-16.0 * i / (kN - 1)));
+        selftest_eval([](float v) { return fast_log2(v); },
+#if defined(__SSE2__)
+                      [](__m128 v) { return fast_log2_ps(v); },
+#else
+                      0,
+#endif
+                      x.data(), kN, r.data(), vec);
+        double e = 0;
+        for (int i = 0; i < kN; ++i) e = max(e, fabs(r[i] - log2(static_cast<double>(x[i]))));
+        t.check("fast_log2, x in [2^-16, 1]" + tag, e, kFastLog2MaxAbs);
+        // exp2 over [-16, 0] (the exponents pow produces on that domain): relative error
+        for (int i = 0; i < kN; ++i) x[i] = static_cast<float>(-16.0 * i / (kN - 1));
+        selftest_eval([](float v) { return fast_exp2(v); },
+#if defined(__SSE2__)
+                      [](__m128 v) { return fast_exp2_ps(v); },
+#else
+                      0,
+#endif
+                      x.data(), kN, r.data(), vec);
+        e = 0;
+        for (int i = 0; i < kN; ++i) {
+            const double ref = exp2(static_cast<double>(x[i]));
+            e = max(e, fabs(r[i] - ref) / ref);
+        }
+        t.check("fast_exp2, x in [-16, 0]" + tag, e, kFastExp2MaxRel);
+        // pow over x in [2^-16, 1], y in [0.1, 10]: relative error where the result is a normal float
+        e = 0;
+        const int kX = 1 << 14;
+        x.resize(kX); r.resize(kX);
+        for (int i = 0; i < kX; ++i) x[i] = static_cast<float>(exp2(-16.0 * i / (kX - 1)));
+        for (int j = 0; j <= 99; ++j) {
+            const float y = 0.1f + j * 0.1f;
+            selftest_eval([y](float v) { return fast_pow(v, y); },
+#if defined(__SSE2__)
+                          [y](__m128 v) { return fast_pow_ps(v, y); },
+#else
+                          0,
+#endif
+                          x.data(), kX, r.data(), vec);
+            for (int i = 0; i < kX; ++i) {
+                const double ref = pow(static_cast<double>(x[i]), static_cast<double>(y));
+                if (ref >= 1.2e-38) e = max(e, fabs(r[i] - ref) / ref);
+            }
+        }
+        t.check("fast_pow, x in [2^-16, 1], y in [0.1, 10]" + tag, e, kFastPowMaxRel);
+        x.resize(kN); r.resize(kN);
+    }
+}
+
+static void selftest_hd16(SelfTest& t) {
+    Image16 in; in.w = 65536; in.h = 1; in.c = 1;
+    in.data.resize(65536);
+    for (int v = 0; v < 65536; ++v) in.data[v] = static_cast<uint16_t>(v);
+    for (double g : { 0.1, 0.25, 1 / 2.2, 0.8, 1.0, 1.8, 2.2, 3.0, 5.0, 10.0 }) {
+        const Image16 out = op_gamma_hd(in, static_cast<float>(g));
+        double e = 0;
+        for (int v = 0; v < 65536; ++v) e = max(e, fabs(out.data[v] - nearbyint(65535.0 * pow(v / 65535.0, g))));
+        ostringstream name;
+        name << "op_gamma_hd 16-bit, gamma " << setprecision(3) << g;
+        t.check(name.str(), e, 1.0);
+    }
+    const Image16 out = op_log_hd(in);
+    double e = 0;
+    for (int v = 0; v < 65536; ++v) e = max(e, fabs(out.data[v] - nearbyint(65535.0 * log2(1.0 + v) / 16.0)));
+    t.check("op_log_hd 16-bit", e, 1.0);
+}
+
+// warp_reference(in, inv, x, y, mode, ch, edge): double-precision value of output pixel (x, y),
+// channel ch, for inverse map inv (the definition warp_affine() implements); edge is set when the
+// sample lies within 1e-3 px of a coverage or nearest-neighbour boundary, where rounding may differ.
+template <typename T>
+static double warp_reference(const ImageT<T>& in, const Affine& inv, int x, int y, WarpInterp mode, int ch, bool& edge) {
+    const double u = inv.a * (x + 0.5) + inv.b * (y + 0.5) + inv.c, v = inv.d * (x + 0.5) + inv.e * (y + 0.5) + inv.f;
+    auto near_int = [](double t) { return fabs(t - nearbyint(t)) < 1e-3; };
+    edge = near_int(u) || near_int(v);
+    if (u < 0 || v < 0 || u >= in.w || v >= in.h) return 0.0;
+    auto px = [&](int i, int j) {
+        return static_cast<double>(in.data[(static_cast<size_t>(clamp_val(j, 0, in.h - 1)) * in.w + clamp_val(i, 0, in.w - 1)) * in.c + ch]);
+    };
+    if (mode == WarpInterp::Nearest) return px(static_cast<int>(u), static_cast<int>(v));
+    const double fx = u - 0.5, fy = v - 0.5;
+    const int x0 = static_cast<int>(floor(fx)), y0 = static_cast<int>(floor(fy));
+    const double ax = fx - x0, ay = fy - y0;
+    return (px(x0, y0) * (1 - ax) + px(x0 + 1, y0) * ax) * (1 - ay) + (px(x0, y0 + 1) * (1 - ax) + px(x0 + 1, y0 + 1) * ax) * ay;
+}
+
+// Warp against warp_reference() on thin (1xN, Nx1, 1x1) and regular sources, 8- and 16-bit:
+// one-pixel sources have no bilinear interior, so every covered pixel must take the checked path.
+static void selftest_warp(SelfTest& t) {
+    uint32_t seed = 12345;
+    auto rnd = [&]() { seed = seed * 1664525u + 1013904223u; return seed >> 16; };
+    auto make = [&](auto& im, int w, int h, int c, uint32_t mask) {
+        im.w = w; im.h = h; im.c = c;
+        im.data.resize(static_cast<size_t>(w) * h * c);
+        for (auto& v : im.data) v = static_cast<typename remove_reference<decltype(v)>::type>(rnd() & mask);
+    };
+    auto run = [&](const auto& in, const char* tag) {
+        for (double deg : { 0.0, 7.0, 33.0, 90.0, 180.0 }) {
+            const double r = deg * 3.14159265358979323846 / 180.0;
+            Affine rot; rot.a = cos(r); rot.b = sin(r); rot.d = -sin(r); rot.e = cos(r);
+            Affine sc; sc.a = sc.e = 2.5;
+            Affine pre; pre.c = -0.5 * in.w; pre.f = -0.5 * in.h;
+            Affine m = affine_mul(rot, affine_mul(sc, pre)), inv;
+            int W = 0, H = 0;
+            affine_fit(m, in.w, in.h, W, H);
+            affine_invert(m, inv);
+            for (WarpInterp mode : { WarpInterp::Nearest, WarpInterp::Bilinear }) {
+                const auto out = warp_affine(in, m, W, H, mode, static_cast<typename remove_reference<decltype(in.data[0])>::type>(0));
+                double e = 0;
+                for (int y = 0; y < H; ++y)
+                    for (int x = 0; x < W; ++x)
+                        for (int ch = 0; ch < in.c; ++ch) {
+                            bool edge = false;
+                            const double ref = warp_reference(in, inv, x, y, mode, ch, edge);
+                            if (!edge) e = max(e, fabs(out.data[(static_cast<size_t>(y) * W + x) * in.c + ch] - ref));
+                        }
+                ostringstream name;
+                name << "warp " << (mode == WarpInterp::Nearest ? "nearest " : "bilinear ") << tag << " " << in.w << "x" << in.h
+                     << ", rotate " << deg;
+                const double q11 = sizeof(in.data[0]) == 1 ? 1.0 : 65535.0 / kBilinOne;   // Q11 weight step
+                t.check(name.str(), e, mode == WarpInterp::Nearest ? 0.0 : q11);
+            }
+        }
+    };
+    Image a;
+    Image16 b;
+    make(a, 33, 1, 3, 0xFF);  run(a, "rgb");
+    make(a, 1, 33, 3, 0xFF);  run(a, "rgb");
+    make(a, 1, 1, 1, 0xFF);   run(a, "gray");
+    make(a, 37, 23, 1, 0xFF); run(a, "gray");
+    make(b, 40, 1, 1, 0xFFFF); run(b, "gray16");
+}
+
+static bool run_selftest() {
+    SelfTest t;
+    cout << "fast math:\n";
+    selftest_fast_math(t);
+    cout << "16-bit point ops:\n";
+    selftest_hd16(t);
+    cout << "affine warp:\n";
+    selftest_warp(t);
+    cout << (t.ok ? "selftest: all checks passed\n" : "selftest: FAILED\n");
+    return t.ok;
+}
+
 // ---------------------- [CLI / USAGE] ----------------------
 // Commands:
 //   read    <in.(bmp|raw|jpg|jpeg|png)> <out.(pgm|ppm|bmp)>
-//   enhance <neg|log|gamma> [gamma] <in.(bmp|raw)> <out.(pgm|ppm|bmp)>
-//   resize  <nearest|bilinear> <in|W> <W|in> <H> <out>
+//   enhance <neg|log|gamma|equalize|clahe|autolevels|gray> [gamma] <in.(bmp|raw)> <out.(pgm|ppm|bmp)>
+//   enhance lut <table.cube> <in.(bmp|raw)> <out.(pgm|ppm|bmp)>
+//   enhance curve <x:y,...|@file|-> <in> <out>
+//   enhance colormap <hot|jet|bone|viridis|@file> <in> <out>   (gray -> RGB)
+//   (curve / gamma / log keep 16-bit PGM/PPM input at 16 bits)
+//   resize  <nearest|bilinear|area|bicubic|lanczos3> <in|W> <W|in> <H> <out>
+//   resize  <mode> <in> <W>x<H>:<out> [<W>x<H>:<out> ...]   (several renditions from one decode)
+//   stats   <in.(bmp|raw|pgm|ppm)> [out.(csv|json)]
+//   threshold <otsu|multiotsu K|fixed T[,T2,T3]> <in> <out>
+//   combine <add|sub|absdiff|mul|blend> <a> <b> <out>   (both 8-bit, or both 16-bit PGM/PPM)
+//   overlay <base> <map> <out>             (map: gray; colored and blended where map >= --thr)
+//   pyramid <gaussian|box> <in> <out_dir|out.pyr>   (all levels in one cascaded pass)
+//   warp    <nearest|bilinear> <in> <out>   (affine: --matrix, or --rotate/--scale/--shear/--translate)
+//   selftest                               (checks documented accuracy bounds; exit 1 on failure)
+// Options (anywhere after the command, "--key" or "--key=value"):
+//   --threads=N             worker threads (default: all cores)
+//   --interp=tetra|trilinear 3D LUT interpolation (default: tetra)
+//   --lut=<table.cube>      resize: apply a color LUT to the resized output
+//   --linear                resize bilinear|area|bicubic|lanczos3 / enhance log|gamma: work in linear light (sRGB decode/encode)
+//   --reference             resize bilinear: original double-precision path (for checking the fixed-point one)
+//   --scalar                resize bilinear / warp: disable the SIMD kernels (output is identical)
+//   --bench[=N]             resize: print best-of-N (default 5) resample time and MP/s
+//   --stream                resize nearest|bilinear|area: read, resize and write row by row (memory O(width));
+//                           the default for several targets unless --linear/--lut/--reference/--bench
+//   --tiles=GXxGY           clahe: tile grid (default 8x8)
+//   --clip=F                clahe: clip limit, multiple of the mean bin height (default 2; 0 = off)
+//   --low=P --high=P        autolevels: percentiles mapped to 0 / 255 (default 0.5 / 99.5)
+//   --per-channel           autolevels: stretch each channel on its own (default: linked)
+//   --subsample=N           autolevels: histogram from every N-th row/column (default 1)
+//   --labels                threshold: write class indices 0..K-1 (default: levels spread over 0..255)
+//   --spline                curve: monotone cubic through the points (default: piecewise linear)
+//   --r= --g= --b=          curve: extra per-channel curves, applied after the master curve
+//   --scale=F               combine mul: output = a*b/max * F (default 1)
+//   --alpha=F               combine blend: weight of b; overlay: opacity of the colored map (default 0.5)
+//   --cmap=NAME|@file       overlay colormap (default hot)
+//   --thr=T                 overlay: map values below T are left transparent (default 1)
+//   --size=WxH              overlay output size (default: base size); inputs are resized as needed
+//   --resize=nearest|bilinear   overlay: resampler used for on-the-fly resizing (default bilinear)
+//   --gray                  any command: load inputs as single-channel (BMP rows convert during decode)
+//   --bt709                 gray / --gray: BT.709 luma weights (default BT.601)
+//   --luma                  stats: histogram of BT.601 luminance instead of per channel
+//   --mask=<mask>           stats: count only pixels where the mask is non-zero
+//   --format=csv|json       stats: output format (default: from extension, else csv)
+//   --format=bmp|pgm|ppm    pyramid: file type of the per-level files in a directory (default bmp)
+//   --levels=N              pyramid: number of reduced levels (default: down to 1x1)
+//   --tile=N                pyramid .pyr: tile size in pixels (default 256)
+//   --matrix=a,b,c,d,e,f    warp: forward map x' = a*x + b*y + c, y' = d*x + e*y + f (source -> output pixels)
+//   --rotate=DEG            warp: counter-clockwise rotation about the image centre
+//   --scale=S[,SY]          warp: scale about the centre (applied before the rotation)
+//   --shear=KX[,KY]         warp: x += KX*y, y += KY*x (after scaling, before the rotation)
+//   --translate=TX,TY       warp: shift in output pixels (after the rotation)
+//   --size=WxH|fit          warp: output size (default: input size; fit = bounding box of the result)
+//   --fill=V                warp: value for output pixels outside the source (default 0)
 // Notes:
 //   - .raw is 512x512 8-bit gray by convention.
 //   - JPEG/PNG: not decoded in stdlib build; convert externally.
 //   - resize accepts both arg orders (in,W,H,out) or (W,H,in,out).
+//   - pyramid into a directory writes <dir>/level0.<ext> (the input) .. levelN.<ext>; the directory must exist.
+//   - stats on a 16-bit PGM/PPM uses 65536 bins; without an output file the table goes to stdout.
 static void usage() {
     cerr <<
     "Usage:\n"
     "  Read:       main read <in.(bmp|raw|jpg|jpeg|png)> <out.(pgm|ppm|bmp)>\n"
-    "  Enhance:    main enhance <neg|log|gamma> [gamma] <in.(bmp|raw)> <out.(pgm|ppm|bmp)>\n"
-    "  Resize:     main resize <nearest|bilinear> <in.(bmp|raw)> <newW> <newH> <out.(pgm|ppm|bmp)>\n";
+    "  Enhance:    main enhance <neg|log|gamma|equalize|clahe|autolevels|gray> [gamma] <in.(bmp|raw)> <out.(pgm|ppm|bmp)>\n"
+    "              (log|gamma: [--linear]; clahe: [--tiles=8x8] [--clip=2];\n"
+    "               autolevels: [--low=0.5] [--high=99.5] [--per-channel] [--subsample=N])\n"
+    "              main enhance curve <x:y,x:y,...|@file|-> <in> <out> [--spline] [--r=..] [--g=..] [--b=..]\n"
+    "              main enhance colormap <hot|jet|bone|viridis|@file> <in> <out>\n"
+    "              main enhance lut <table.cube> <in.(bmp|raw)> <out.(pgm|ppm|bmp)> [--interp=tetra|trilinear]\n"
+    "  Resize:     main resize <nearest|bilinear|area|bicubic|lanczos3> <in.(bmp|raw)> <newW> <newH> <out.(pgm|ppm|bmp)> [--lut=table.cube] [--linear] [--reference]\n"
+    "              [--scalar] [--bench[=N]] [--stream]\n"
+    "              main resize <mode> <in> <W>x<H>:<out> [<W>x<H>:<out> ...]   (one decode, all renditions)\n"
+    "  Stats:      main stats <in.(bmp|raw|pgm|ppm)> [out.(csv|json)] [--luma] [--mask=m.bmp] [--format=csv|json]\n"
+    "  Threshold:  main threshold <otsu|multiotsu K|fixed T[,T2,T3]> <in.(bmp|raw|pgm)> <out.(pgm|bmp)> [--labels]\n"
+    "  Combine:    main combine <add|sub|absdiff|mul|blend> <a> <b> <out> [--scale=F] [--alpha=F]\n"
+    "  Overlay:    main overlay <base> <map> <out> [--cmap=NAME|@file] [--alpha=F] [--thr=T] [--size=WxH]\n"
+    "              [--resize=nearest|bilinear]\n"
+    "  Pyramid:    main pyramid <gaussian|box> <in> <out_dir|out.pyr> [--levels=N] [--format=bmp|pgm|ppm] [--tile=N]\n"
+    "  Warp:       main warp <nearest|bilinear> <in> <out> [--matrix=a,b,c,d,e,f | --rotate=DEG --scale=S[,SY]\n"
+    "              --shear=KX[,KY] --translate=TX,TY] [--size=WxH|fit] [--fill=V] [--scalar]\n"
+    "  Selftest:   main selftest\n"
+    "  Options:    --threads=N  --gray [--bt709]\n";
 }
 
 // parse_int_strict(s, out): returns true if s is a valid integer (no trailing junk), stores result in out
@@ -507,13 +4191,98 @@ static bool parse_int_strict(const std::string& s, int& out) {
     return false;
 }
 
+// parse_double_strict(s, out): like parse_int_strict for a finite floating-point value
+// ("nan", "inf", empty or trailing junk -> false); never throws, unlike stod
+static bool parse_double_strict(const string& s, double& out) {
+    char* end = nullptr;
+    const double val = strtod(s.c_str(), &end);
+    if (s.empty() || end != s.c_str() + s.size() || !std::isfinite(val)) return false;
+    out = val;
+    return true;
+}
+
+// parse_wxh(s, w, h): "WxH" (or a single "N" meaning NxN) with positive integers
+static bool parse_wxh(const string& s, int& w, int& h) {
+    const size_t x = s.find_first_of("xX");
+    if (x == string::npos) {
+        if (!parse_int_strict(s, w)) return false;
+        h = w;
+    } else if (!parse_int_strict(s.substr(0, x), w) || !parse_int_strict(s.substr(x + 1), h)) {
+        return false;
+    }
+    return w > 0 && h > 0;
+}
+
+// parse_doubles(s, out): comma-separated numbers ("1.5,-2"); false on an empty field or trailing junk
+static bool parse_doubles(const string& s, vector<double>& out) {
+    out.clear();
+    size_t i = 0;
+    for (;;) {
+        const size_t j = s.find(',', i);
+        const string f = s.substr(i, j == string::npos ? string::npos : j - i);
+        char* end = nullptr;
+        const double v = strtod(f.c_str(), &end);
+        if (f.empty() || end != f.c_str() + f.size()) return false;
+        out.push_back(v);
+        if (j == string::npos) return true;
+        i = j + 1;
+    }
+}
+
+// CliArgs: argv split into positional args (pos[0] is the program name, so
+// indices match argv) and "--key[=value]" options (value "" for bare flags).
+struct CliArgs {
+    vector<string> pos;
+    map<string, string> opt;
+    bool has(const string& k) const { return opt.count(k) != 0; }
+    string get(const string& k, const string& def = "") const {
+        auto it = opt.find(k);
+        return it == opt.end() ? def : it->second;
+    }
+};
+
+static CliArgs split_args(int argc, char** argv) {
+    CliArgs a;
+    for (int i = 0; i < argc; ++i) {
+        const string s = argv[i];
+        if (i > 0 && s.size() > 2 && s[0] == '-' && s[1] == '-') {
+            const size_t eq = s.find('=');
+            if (eq == string::npos) a.opt[s.substr(2)] = "";
+            else a.opt[s.substr(2, eq - 2)] = s.substr(eq + 1);
+        } else {
+            a.pos.push_back(s);
+        }
+    }
+    return a;
+}
+
+// parse_lut_interp(args, out): reads --interp (tetra|trilinear); false on unknown value
+static bool parse_lut_interp(const CliArgs& args, LutInterp& out) {
+    const string v = args.get("interp", "tetra");
+    if (v == "tetra" || v == "tetrahedral") { out = LutInterp::Tetrahedral; return true; }
+    if (v == "trilinear")                   { out = LutInterp::Trilinear;   return true; }
+    cerr << "Unknown --interp '" << v << "' (use tetra|trilinear)\n";
+    return false;
+}
+
 int main(int argc, char** argv) {
-    if (argc < 2) { usage(); return 1; }
-    const string cmd = argv[1];
+    const CliArgs args = split_args(argc, argv);
+    const vector<string>& av = args.pos;
+    const int ac = static_cast<int>(av.size());
+    if (ac < 2) { usage(); return 1; }
+    const string cmd = av[1];
+
+    if (args.has("threads")) {
+        if (!parse_int_strict(args.get("threads"), g_threads) || g_threads < 1) {
+            cerr << "--threads must be a positive integer.\n"; return 1;
+        }
+    }
+    g_load_gray = args.has("gray");
+    if (args.has("bt709")) g_luma_weights = LumaWeights::BT709;
 
     if (cmd == "read") {
-        if (argc != 4) { usage(); return 1; }
-        const string inpath = argv[2], outpath = argv[3];
+        if (ac != 4) { usage(); return 1; }
+        const string inpath = av[2], outpath = av[3];
         Image im = load_by_extension(inpath);
         if (im.empty()) return 1;
         dump_center_10x10(im, "original");
@@ -523,21 +4292,97 @@ int main(int argc, char** argv) {
     }
 
     if (cmd == "enhance") {
-        if (argc < 5) { usage(); return 1; }
-        const string op = argv[2];
+        if (ac < 5) { usage(); return 1; }
+        const string op = av[2];
 
         string inpath, outpath;
         float gamma = 1.0f;
+        CubeLut lut;
+        LutInterp interp = LutInterp::Tetrahedral;
+        int gx = 8, gy = 8;
+        float clip = 2.0f;
+        Colormap cmap;
+
+        if (op == "clahe") {
+            if (args.has("tiles") && !parse_wxh(args.get("tiles"), gx, gy)) {
+                cerr << "--tiles must be GXxGY (e.g. 8x8)\n"; return 1;
+            }
+            double v = clip;
+            if (args.has("clip") && !parse_double_strict(args.get("clip"), v)) {
+                cerr << "--clip must be a finite number\n"; return 1;
+            }
+            clip = static_cast<float>(v);
+        }
+        double low_pct = 0.5, high_pct = 99.5;
+        int subsample = 1;
+        if (op == "autolevels") {
+            if ((args.has("low") && !parse_double_strict(args.get("low"), low_pct)) ||
+                (args.has("high") && !parse_double_strict(args.get("high"), high_pct)) ||
+                !(low_pct >= 0.0 && low_pct < high_pct && high_pct <= 100.0)) {
+                cerr << "Need 0 <= --low < --high <= 100\n"; return 1;
+            }
+            if (args.has("subsample") && (!parse_int_strict(args.get("subsample"), subsample) || subsample < 1)) {
+                cerr << "--subsample must be a positive integer\n"; return 1;
+            }
+        }
 
-        if (op == "gamma") {
-            if (argc != 6) { usage(); return 1; }
-            gamma  = stof(argv[3]);
-            inpath = argv[4];
-            outpath= argv[5];
+        ToneCurve master, chan[3];
+        if (op == "curve") {
+            if (ac != 6) { usage(); return 1; }
+            const bool spline = args.has("spline");
+            // "-" = no master curve (channel curves only)
+            if (av[3] != "-" && !parse_curve(av[3], spline, master)) return 1;
+            const char* names[3] = { "r", "g", "b" };
+            for (int k = 0; k < 3; ++k) {
+                if (args.has(names[k]) && !parse_curve(args.get(names[k]), spline, chan[k])) return 1;
+            }
+            inpath = av[4];
+            outpath= av[5];
+        }
+
+        if (op == "curve") {
+            // already parsed
+        } else if (op == "gamma") {
+            if (ac != 6) { usage(); return 1; }
+            double g = 0.0;
+            if (!parse_double_strict(av[3], g) || g <= 0.0) {
+                cerr << "gamma must be a positive number\n"; return 1;
+            }
+            gamma  = static_cast<float>(min(g, 1e30));   // stays finite as a float
+            inpath = av[4];
+            outpath= av[5];
+        } else if (op == "colormap") {
+            if (ac != 6) { usage(); return 1; }
+            if (!load_colormap(av[3], cmap)) return 1;
+            inpath = av[4];
+            outpath= av[5];
+        } else if (op == "lut") {
+            if (ac != 6) { usage(); return 1; }
+            if (!parse_lut_interp(args, interp)) return 1;
+            lut = load_cube(av[3]);
+            if (lut.empty()) return 1;
+            inpath = av[4];
+            outpath= av[5];
         } else {
-            if (argc != 5) { usage(); return 1; }
-            inpath = argv[3];
-            outpath= argv[4];
+            if (ac != 5) { usage(); return 1; }
+            inpath = av[3];
+            outpath= av[4];
+        }
+
+        // 16-bit PGM/PPM stays 16-bit through ops that have a 16-bit path
+        if (is_pnm16(inpath)) {
+            Image16 im16 = load_by_extension16(inpath);
+            if (im16.empty()) return 1;
+            Image16 out16;
+            if      (op == "curve") out16 = op_curve16(im16, master, chan);
+            else if (op == "gamma") out16 = op_gamma_hd(im16, gamma);
+            else if (op == "log")   out16 = op_log_hd(im16);
+            else if (op == "gray")  out16 = op_gray(im16, g_luma_weights);
+            else { cerr << "enhance " << op << " has no 16-bit path\n"; return 1; }
+            if (out16.empty()) return 1;
+            if (!write_by_extension16(outpath, out16)) { cerr << "Write failed\n"; return 1; }
+            cout << "Saved: " << outpath << "\n";
+            return 0;
         }
 
         Image im = load_by_extension(inpath);
@@ -545,9 +4390,17 @@ int main(int argc, char** argv) {
 
         Image out;
         if      (op == "neg")   out = op_negative(im);
-        else if (op == "log")   out = op_log(im);
-        else if (op == "gamma") out = op_gamma(im, gamma);
+        else if (op == "curve") out = op_curve(im, master, chan);
+        else if (op == "log")   out = op_log(im, args.has("linear"));
+        else if (op == "gamma") out = op_gamma(im, gamma, args.has("linear"));
+        else if (op == "equalize") out = op_equalize(im);
+        else if (op == "clahe") out = op_clahe(im, gx, gy, clip);
+        else if (op == "autolevels") out = op_autolevels(im, low_pct, high_pct, args.has("per-channel"), subsample);
+        else if (op == "lut")   out = op_cube_lut(im, lut, interp);
+        else if (op == "colormap") out = op_colormap(im, cmap);
+        else if (op == "gray")  out = op_gray(im, g_luma_weights);
         else { usage(); return 1; }
+        if (out.empty()) return 1;
 
         dump_center_10x10(out, "enhanced");
         if (!write_by_extension(outpath, out)) { std::cerr << "Write failed\n"; return 1; }
@@ -556,51 +4409,458 @@ int main(int argc, char** argv) {
     }
 
     if (cmd == "resize") {
-        if (argc != 7) { usage(); return 1; }
-        const std::string mode = argv[2];
+        if (ac < 5) { usage(); return 1; }
+        const std::string mode = av[2];
 
-        // Accept both:
+        // Accept:
         //  A) resize <mode> <in> <W> <H> <out>
         //  B) resize <mode> <W> <H> <in> <out>
-        std::string inpath, outpath;
+        //  C) resize <mode> <in> <W>x<H>:<out> [<W>x<H>:<out> ...]   (several renditions, one decode)
+        std::string inpath;
+        vector<ResizeTarget> targets;
+
+        if (av[4].find(':') != string::npos) {
+            // Form C
+            inpath = av[3];
+            for (int i = 4; i < ac; ++i) {
+                const size_t colon = av[i].find(':');
+                ResizeTarget t{ 0, 0, "" };
+                if (colon == string::npos || colon + 1 == av[i].size() || !parse_wxh(av[i].substr(0, colon), t.w, t.h)) {
+                    std::cerr << "Bad target '" << av[i] << "' (expected WxH:out)\n"; return 1;
+                }
+                t.path = av[i].substr(colon + 1);
+                targets.push_back(t);
+            }
+        } else {
+            if (ac != 7) { usage(); return 1; }
+            std::string outpath;
+            int newW = 0, newH = 0;
+
+            int tmpW = 0, tmpH = 0;
+            bool aW = parse_int_strict(av[3], tmpW);
+            bool aH = parse_int_strict(av[4], tmpH);
+
+            if (aW && aH) {
+                // Form B
+                newW   = tmpW;
+                newH   = tmpH;
+                inpath = av[5];
+                outpath= av[6];
+            } else {
+                // Form A
+                inpath = av[3];
+                if (!parse_int_strict(av[4], newW) || !parse_int_strict(av[5], newH)) {
+                    std::cerr << "Width/Height must be integers.\n"; return 1;
+                }
+                outpath= av[6];
+            }
+
+            if (newW <= 0 || newH <= 0) { std::cerr << "Width/Height must be > 0.\n"; return 1; }
+            targets.push_back({ newW, newH, outpath });
+        }
+
+        // Optional calibration LUT, loaded up front so a bad table fails before any work
+        CubeLut lut;
+        LutInterp interp = LutInterp::Tetrahedral;
+        if (args.has("lut")) {
+            if (!parse_lut_interp(args, interp)) return 1;
+            lut = load_cube(args.get("lut"));
+            if (lut.empty()) return 1;
+        }
+
+        ResizeKernel kern = ResizeKernel::Bicubic;
+        const bool filtered = (mode == "bicubic" || mode == "lanczos3");
+        if (mode == "lanczos3") kern = ResizeKernel::Lanczos3;
+        if (mode != "nearest" && mode != "bilinear" && mode != "area" && !filtered) { usage(); return 1; }
+        int reps = 5;
+        if (args.has("bench") && !args.get("bench").empty() &&
+            (!parse_int_strict(args.get("bench"), reps) || reps < 1)) {
+            cerr << "--bench=N needs a positive run count\n"; return 1;
+        }
+        g_scalar_kernels = args.has("scalar");
+
+        // Row streaming, file to file in memory O(width): with --stream, and by default for several
+        // targets (they then share every source row read). The whole-image options don't apply.
+        const bool wholeImage = args.has("linear") || args.has("lut") || args.has("reference") || args.has("bench");
+        if (args.has("stream") || (targets.size() > 1 && !filtered && !wholeImage)) {
+            if (filtered) { cerr << "--stream supports nearest|bilinear|area\n"; return 1; }
+            if (wholeImage) {
+                cerr << "--stream cannot be combined with --linear, --lut, --reference or --bench\n"; return 1;
+            }
+            const StreamMode sm = mode == "nearest" ? StreamMode::Nearest
+                                : mode == "area"    ? StreamMode::Area : StreamMode::Bilinear;
+            if (!resize_stream(inpath, targets, sm)) return 1;
+            for (const ResizeTarget& t : targets) std::cout << "Saved: " << t.path << " (" << t.w << "x" << t.h << ")\n";
+            return 0;
+        }
+
+        Image im = load_by_extension(inpath);
+        if (im.empty()) return 1;
+        const bool linear = args.has("linear");
+        const Image16 lin = linear ? srgb_to_linear(im) : Image16{};   // shared by all targets
+
+        const bool ref = args.has("reference");
         int newW = 0, newH = 0;
+        auto run = [&]() -> Image {
+            if (mode == "nearest") return resize_nearest(im, newW, newH);   // no blending: --linear is moot
+            if (filtered) {
+                return linear ? linear_to_srgb(resize_filtered(lin, newW, newH, kern))
+                              : resize_filtered(im, newW, newH, kern);
+            }
+            if (mode == "area") {
+                return linear ? linear_to_srgb(resize_area(lin, newW, newH))
+                              : resize_area(im, newW, newH);
+            }
+            if (linear) {
+                return linear_to_srgb(ref ? resize_bilinear_ref(lin, newW, newH) : resize_bilinear(lin, newW, newH));
+            }
+            return ref ? resize_bilinear_ref(im, newW, newH) : resize_bilinear(im, newW, newH);
+        };
 
-        int tmpW = 0, tmpH = 0;
-        bool aW = parse_int_strict(argv[3], tmpW);
-        bool aH = parse_int_strict(argv[4], tmpH);
+        for (const ResizeTarget& t : targets) {
+            newW = t.w; newH = t.h;
+            Image out = run();
 
-        if (aW && aH) {
-            // Form B
-            newW   = tmpW;
-            newH   = tmpH;
-            inpath = argv[5];
-            outpath= argv[6];
-        } else {
-            // Form A
-            inpath = argv[3];
-            if (!parse_int_strict(argv[4], newW) || !parse_int_strict(argv[5], newH)) {
-                std::cerr << "Width/Height must be integers.\n"; return 1;
+            // --bench[=N]: best-of-N wall time of the resample step alone, in output megapixels per
+            // second; bilinear also times the scalar fixed-point loops and the double reference.
+            if (args.has("bench")) {
+                auto best_ms = [&](const function<Image()>& fn) {
+                    double best = 1e300;
+                    for (int r = 0; r < reps; ++r) {
+                        const auto t0 = chrono::steady_clock::now();
+                        Image tmp = fn();
+                        const auto t1 = chrono::steady_clock::now();
+                        best = min(best, chrono::duration<double, milli>(t1 - t0).count());
+                    }
+                    return best;
+                };
+                auto report = [&](const string& name, double ms) {
+                    cout << "bench " << left << setw(18) << name << right << fixed << setprecision(2) << setw(9) << ms
+                         << " ms  " << setw(9) << (static_cast<double>(newW) * newH / 1e3 / ms) << " MP/s\n";
+                    cout.unsetf(ios::floatfield);
+                };
+                cout << "bench " << im.w << "x" << im.h << " c=" << im.c << " -> " << newW << "x" << newH
+                     << ", " << thread_count() << " thread(s), best of " << reps << "\n";
+                report(mode + (ref ? " (reference)" : g_scalar_kernels ? " (scalar)" : ""), best_ms(run));
+                if (mode == "bilinear" && !ref && !linear) {
+                    const bool saved = g_scalar_kernels;
+                    if (!saved) {
+                        g_scalar_kernels = true;
+                        report("bilinear (scalar)", best_ms(run));
+                        g_scalar_kernels = saved;
+                    }
+                    report("bilinear (ref)", best_ms([&]() { return resize_bilinear_ref(im, newW, newH); }));
+                }
             }
-            outpath= argv[6];
+
+            // Color LUT goes on the output: it is the calibrated export, and the table is nonlinear
+            if (!lut.empty()) {
+                out = op_cube_lut(out, lut, interp);
+                if (out.empty()) return 1;
+            }
+
+            dump_center_10x10(out, "resized");
+            if (!write_by_extension(t.path, out)) { std::cerr << "Write failed\n"; return 1; }
+            std::cout << "Saved: " << t.path << "\n";
+        }
+        return 0;
+    }
+
+    if (cmd == "stats") {
+        if (ac != 3 && ac != 4) { usage(); return 1; }
+        const string inpath = av[2];
+        const string outpath = (ac == 4) ? av[3] : "";
+        const string format = args.get("format", file_ext(outpath) == ".json" ? "json" : "csv");
+        if (format != "csv" && format != "json") { cerr << "Unknown --format '" << format << "'\n"; return 1; }
+        const bool luma = args.has("luma");
+
+        Image mask;
+        if (args.has("mask")) {
+            mask = load_by_extension(args.get("mask"));
+            if (mask.empty()) return 1;
+        }
+        const Image* maskp = mask.empty() ? nullptr : &mask;
+
+        Histogram hist;
+        int w = 0, h = 0;
+        if (is_pnm16(inpath)) {
+            Image16 im = load_by_extension16(inpath);
+            if (im.empty()) return 1;
+            hist = compute_histogram(im, luma, maskp);
+            w = im.w; h = im.h;
+        } else {
+            Image im = load_by_extension(inpath);
+            if (im.empty()) return 1;
+            hist = compute_histogram(im, luma, maskp);
+            w = im.w; h = im.h;
+        }
+        if (hist.bins == 0) return 1;
+        const vector<string> names = hist_channel_names(hist, luma);
+
+        if (outpath.empty()) {
+            // table only, so the output can be piped
+            if (format == "json") write_hist_json(cout, hist, names, w, h);
+            else                  write_hist_csv(cout, hist, names);
+            return 0;
+        }
+
+        for (int k = 0; k < hist.channels; ++k) {
+            const HistStats st = hist_stats(hist, k);
+            cout << setw(5) << names[k] << ": count=" << st.count << " min=" << st.min << " max=" << st.max
+                 << " mean=" << fixed << setprecision(2) << st.mean << " stddev=" << st.stddev << defaultfloat << "\n";
         }
+        ofstream out(outpath);
+        if (!out) { cerr << "Cannot write " << outpath << "\n"; return 1; }
+        if (format == "json") write_hist_json(out, hist, names, w, h);
+        else                  write_hist_csv(out, hist, names);
+        if (!out) { cerr << "Write failed\n"; return 1; }
+        cout << "Saved: " << outpath << "\n";
+        return 0;
+    }
 
-        if (newW <= 0 || newH <= 0) { std::cerr << "Width/Height must be > 0.\n"; return 1; }
+    if (cmd == "threshold") {
+        if (ac < 5) { usage(); return 1; }
+        const string method = av[2];
+        const bool hasArg = (method == "multiotsu" || method == "fixed");
+        if (ac != (hasArg ? 6 : 5)) { usage(); return 1; }
+        const string inpath  = av[hasArg ? 4 : 3];
+        const string outpath = av[hasArg ? 5 : 4];
+
+        int thr[3] = {0, 0, 0};
+        int nt = 0;
+        int classes = 2;
+        if (method == "fixed") {
+            // comma-separated, strictly increasing thresholds in 0..254
+            stringstream ss(av[3]);
+            string tok;
+            while (getline(ss, tok, ',')) {
+                int t = 0;
+                if (nt == 3 || !parse_int_strict(tok, t) || t < 0 || t > 254 || (nt && t <= thr[nt - 1])) {
+                    cerr << "fixed: need 1-3 increasing thresholds in 0..254\n"; return 1;
+                }
+                thr[nt++] = t;
+            }
+            if (nt == 0) { cerr << "fixed: need a threshold\n"; return 1; }
+        } else if (method == "multiotsu") {
+            if (!parse_int_strict(av[3], classes) || classes < 2 || classes > 4) {
+                cerr << "multiotsu: classes must be 2..4\n"; return 1;
+            }
+        } else if (method != "otsu") {
+            usage(); return 1;
+        }
 
         Image im = load_by_extension(inpath);
         if (im.empty()) return 1;
 
-        Image out;
-        if      (mode == "nearest")  out = resize_nearest(im, newW, newH);
-        else if (mode == "bilinear") out = resize_bilinear(im, newW, newH);
+        if (method != "fixed") {
+            const Histogram hist = compute_histogram(im, im.c == 3);
+            if (hist.bins == 0 || !multi_otsu(hist.counts.data(), classes, thr)) return 1;
+            nt = classes - 1;
+        }
+        cout << "Thresholds:";
+        for (int k = 0; k < nt; ++k) cout << " " << thr[k];
+        cout << "\n";
+
+        Image out = op_threshold(im, thr, nt, args.has("labels"));
+        if (out.empty()) return 1;
+        dump_center_10x10(out, "threshold");
+        if (!write_by_extension(outpath, out)) { cerr << "Write failed\n"; return 1; }
+        cout << "Saved: " << outpath << "\n";
+        return 0;
+    }
+
+    if (cmd == "combine") {
+        if (ac != 6) { usage(); return 1; }
+        const string opname = av[2];
+        CombineParams p;
+        if      (opname == "add")     p.op = CombineOp::Add;
+        else if (opname == "sub")     p.op = CombineOp::Sub;
+        else if (opname == "absdiff") p.op = CombineOp::AbsDiff;
+        else if (opname == "mul")     p.op = CombineOp::Mul;
+        else if (opname == "blend")   p.op = CombineOp::Blend;
         else { usage(); return 1; }
+        double scale = p.scale, alpha = p.alpha;
+        if (args.has("scale") && (!parse_double_strict(args.get("scale"), scale) || scale < 0.0)) {
+            cerr << "--scale must be a finite number >= 0\n"; return 1;
+        }
+        if (args.has("alpha") && (!parse_double_strict(args.get("alpha"), alpha) || alpha < 0.0 || alpha > 1.0)) {
+            cerr << "--alpha must be in [0, 1]\n"; return 1;
+        }
+        p.scale = static_cast<float>(min(scale, 1e30));   // stays finite as a float
+        p.alpha = static_cast<float>(alpha);
+        const string pathA = av[3], pathB = av[4], outpath = av[5];
 
-        dump_center_10x10(out, "resized");
-        if (!write_by_extension(outpath, out)) { std::cerr << "Write failed\n"; return 1; }
-        std::cout << "Saved: " << outpath << "\n";
+        const bool a16 = is_pnm16(pathA), b16 = is_pnm16(pathB);
+        if (a16 != b16) { cerr << "combine: inputs differ in bit depth (8 vs 16)\n"; return 1; }
+        if (a16) {
+            Image16 a = load_by_extension16(pathA), b = load_by_extension16(pathB);
+            if (a.empty() || b.empty()) return 1;
+            Image16 out = op_combine(a, b, p);
+            if (out.empty()) return 1;
+            if (!write_by_extension16(outpath, out)) { cerr << "Write failed\n"; return 1; }
+            cout << "Saved: " << outpath << "\n";
+            return 0;
+        }
+        Image a = load_by_extension(pathA), b = load_by_extension(pathB);
+        if (a.empty() || b.empty()) return 1;
+        Image out = op_combine(a, b, p);
+        if (out.empty()) return 1;
+        dump_center_10x10(out, "combined");
+        if (!write_by_extension(outpath, out)) { cerr << "Write failed\n"; return 1; }
+        cout << "Saved: " << outpath << "\n";
+        return 0;
+    }
+
+    if (cmd == "overlay") {
+        if (ac != 5) { usage(); return 1; }
+        Colormap cm;
+        if (!load_colormap(args.has("cmap") ? args.get("cmap") : "hot", cm)) return 1;
+        double alpha = 0.5;
+        if (args.has("alpha") && (!parse_double_strict(args.get("alpha"), alpha) || alpha < 0.0 || alpha > 1.0)) {
+            cerr << "--alpha must be in [0, 1]\n"; return 1;
+        }
+        int thr = 1;
+        if (args.has("thr") && (!parse_int_strict(args.get("thr"), thr) || thr < 0 || thr > 256)) {
+            cerr << "Bad --thr (0..256)\n"; return 1;
+        }
+        const string rs = args.has("resize") ? args.get("resize") : "bilinear";
+        if (rs != "nearest" && rs != "bilinear") { cerr << "Bad --resize: " << rs << "\n"; return 1; }
+
+        Image base = load_by_extension(av[2]);
+        Image map  = load_by_extension(av[3]);
+        if (base.empty() || map.empty()) return 1;
+        if (map.c == 3) {   // RGB maps are reduced to luminance
+            Image g; g.w = map.w; g.h = map.h; g.c = 1;
+            g.data.resize(static_cast<size_t>(map.w) * map.h);
+            for (size_t i = 0; i < g.data.size(); ++i)
+                g.data[i] = static_cast<uint8_t>(luma_u8(map.data[3*i], map.data[3*i+1], map.data[3*i+2]));
+            map = std::move(g);
+        }
+        int W = base.w, H = base.h;
+        if (args.has("size") && !parse_wxh(args.get("size"), W, H)) { cerr << "Bad --size\n"; return 1; }
+        auto fit = [&](Image& im) {
+            if (im.w == W && im.h == H) return;
+            im = (rs == "nearest") ? resize_nearest(im, W, H) : resize_bilinear(im, W, H);
+        };
+        fit(base); fit(map);
+
+        Image out = op_overlay(base, map, cm, static_cast<float>(alpha), thr);
+        if (out.empty()) return 1;
+        dump_center_10x10(out, "overlay");
+        if (!write_by_extension(av[4], out)) { cerr << "Write failed\n"; return 1; }
+        cout << "Saved: " << av[4] << "\n";
+        return 0;
+    }
+
+    if (cmd == "pyramid") {
+        if (ac != 5) { usage(); return 1; }
+        const string fname = av[2];
+        if (fname != "gaussian" && fname != "box") { usage(); return 1; }
+        int levels = 0, tile = 256;
+        if (args.has("levels") && (!parse_int_strict(args.get("levels"), levels) || levels < 1)) {
+            cerr << "--levels=N needs a positive count\n"; return 1;
+        }
+        if (args.has("tile") && (!parse_int_strict(args.get("tile"), tile) || tile < 1)) {
+            cerr << "--tile=N needs a positive size\n"; return 1;
+        }
+        const string ext = args.has("format") ? args.get("format") : "bmp";
+        if (ext != "bmp" && ext != "pgm" && ext != "ppm") { cerr << "Bad --format: " << ext << "\n"; return 1; }
+
+        Image im = load_by_extension(av[3]);
+        if (im.empty()) return 1;
+        const vector<Image> pyr = build_pyramid(im, fname == "box" ? PyramidFilter::Box : PyramidFilter::Gaussian, levels);
+        vector<const Image*> all(1, &im);
+        for (const Image& l : pyr) all.push_back(&l);
+        for (size_t i = 0; i < all.size(); ++i) cout << "level " << i << ": " << all[i]->w << "x" << all[i]->h << "\n";
+
+        const string outpath = av[4];
+        if (file_ext(outpath) == ".pyr") {
+            if (!write_pyramid(outpath, all, tile)) { cerr << "Write failed\n"; return 1; }
+            cout << "Saved: " << outpath << "\n";
+            return 0;
+        }
+        for (size_t i = 0; i < all.size(); ++i) {
+            const string path = outpath + "/level" + to_string(i) + "." + ext;
+            if (!write_by_extension(path, *all[i])) { cerr << "Write failed\n"; return 1; }
+            cout << "Saved: " << path << "\n";
+        }
+        return 0;
+    }
+
+    if (cmd == "warp") {
+        if (ac != 5) { usage(); return 1; }
+        const string mname = av[2];
+        if (mname != "nearest" && mname != "bilinear") { usage(); return 1; }
+        const WarpInterp mode = mname == "nearest" ? WarpInterp::Nearest : WarpInterp::Bilinear;
+        const string inpath = av[3], outpath = av[4];
+        g_scalar_kernels = args.has("scalar");
+        auto opt_nums = [&](const string& key, size_t n0, size_t n1, vector<double>& v) {
+            if (!args.has(key)) return true;
+            if (parse_doubles(args.get(key), v) && v.size() >= n0 && v.size() <= n1) return true;
+            cerr << "Bad --" << key << "\n";
+            return false;
+        };
+        vector<double> mat, rot, scl, shr, tr;
+        if (!opt_nums("matrix", 6, 6, mat) || !opt_nums("rotate", 1, 1, rot) || !opt_nums("scale", 1, 2, scl) ||
+            !opt_nums("shear", 1, 2, shr) || !opt_nums("translate", 2, 2, tr)) return 1;
+        if (!mat.empty() && (!rot.empty() || !scl.empty() || !shr.empty() || !tr.empty())) {
+            cerr << "warp: --matrix excludes --rotate/--scale/--shear/--translate\n"; return 1;
+        }
+        int fillv = 0;
+        if (args.has("fill") && (!parse_int_strict(args.get("fill"), fillv) || fillv < 0 || fillv > 65535)) {
+            cerr << "Bad --fill (0..65535)\n"; return 1;
+        }
+        const string sz = args.get("size");
+        const bool fit = sz == "fit";
+
+        // forward map about the centres: out = Cout + t + R * Sh * S * (in - Cin)
+        auto build = [&](int w, int h, Affine& m, int& W, int& H) {
+            W = w; H = h;
+            if (!sz.empty() && !fit && !parse_wxh(sz, W, H)) { cerr << "Bad --size\n"; return false; }
+            if (!mat.empty()) {
+                m.a = mat[0]; m.b = mat[1]; m.c = mat[2]; m.d = mat[3]; m.e = mat[4]; m.f = mat[5];
+            } else {
+                Affine sc, sk, r, pre, post;
+                if (!scl.empty()) { sc.a = scl[0]; sc.e = scl.size() > 1 ? scl[1] : scl[0]; }
+                if (!shr.empty()) { sk.b = shr[0]; sk.d = shr.size() > 1 ? shr[1] : 0.0; }
+                if (!rot.empty()) {
+                    const double t = rot[0] * 3.14159265358979323846 / 180.0;
+                    r.a = cos(t); r.b = sin(t); r.d = -sin(t); r.e = cos(t);   // y points down
+                }
+                pre.c = -0.5 * w; pre.f = -0.5 * h;
+                post.c = 0.5 * W + (tr.empty() ? 0.0 : tr[0]);
+                post.f = 0.5 * H + (tr.empty() ? 0.0 : tr[1]);
+                m = affine_mul(post, affine_mul(r, affine_mul(sk, affine_mul(sc, pre))));
+            }
+            if (fit) affine_fit(m, w, h, W, H);
+            return true;
+        };
+        Affine m;
+        int W = 0, H = 0;
+        if (is_pnm16(inpath)) {
+            Image16 im = load_by_extension16(inpath);
+            if (im.empty() || !build(im.w, im.h, m, W, H)) return 1;
+            Image16 out = warp_affine(im, m, W, H, mode, static_cast<uint16_t>(fillv));
+            if (out.empty()) return 1;
+            if (!write_by_extension16(outpath, out)) { cerr << "Write failed\n"; return 1; }
+            cout << "Saved: " << outpath << "\n";
+            return 0;
+        }
+        Image im = load_by_extension(inpath);
+        if (im.empty() || !build(im.w, im.h, m, W, H)) return 1;
+        Image out = warp_affine(im, m, W, H, mode, static_cast<uint8_t>(min(fillv, 255)));
+        if (out.empty()) return 1;
+        dump_center_10x10(out, "warped");
+        if (!write_by_extension(outpath, out)) { cerr << "Write failed\n"; return 1; }
+        cout << "Saved: " << outpath << "\n";
         return 0;
     }
 
+    if (cmd == "selftest") {
+        if (ac != 2) { usage(); return 1; }
+        return run_selftest() ? 0 : 1;
+    }
 
     usage();
     return 1;
-}
\ No newline at end of file
+}